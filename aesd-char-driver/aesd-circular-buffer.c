@@ -10,8 +10,16 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#define aesd_ring_alloc(n) kvcalloc(n, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define aesd_ring_free(p) kvfree(p)
 #else
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#define aesd_ring_alloc(n) calloc(n, sizeof(struct aesd_buffer_entry))
+#define aesd_ring_free(p) free(p)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -33,84 +41,121 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     * TODO: implement per description
     */
 
-    uint8_t currentIndex;
-    size_t cumulativeOffset = 0;
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    struct aesd_buffer_entry *entry;
     
-    /* Check if buffer is empty. Must consider the full flag as well,
-     * since in_offs == out_offs can mean the buffer is either full or empty */
-    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+    /* char_offset is beyond the available data, or the buffer is empty */
+    if (char_offset >= buffer->total_size) {
         return NULL;
     }
     
-    /* Start from output entry */
-    currentIndex = buffer->out_offs;
-    
-    /* Iterate through all entries in the buffer */
-    while (1) {
-        struct aesd_buffer_entry *currentEntry = &buffer->entry[currentIndex];
-        
-        /* Check if this entry contains the requested offset */
-        if (char_offset < cumulativeOffset + currentEntry->size) {
-            /* Found the entry containing the requested offset */
-            *entry_offset_byte_rtn = char_offset - cumulativeOffset;
-            return currentEntry;
-        }
-        
-        /* Move to the next entry */
-        cumulativeOffset += currentEntry->size;
-        currentIndex = (currentIndex + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    /* Every entry knows where it starts, so binary search for the last one
+     * starting at or before char_offset, in O(log n) steps. The loop keeps
+     * entry low starting at or before char_offset and entry high after it. */
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
         
-        /* Stop when we've wrapped around to in_offs */
-        if (currentIndex == buffer->in_offs) {
-            break;
+        if (aesd_circular_buffer_entry_start(buffer, mid) <= char_offset) {
+            low = mid;
+        } else {
+            high = mid;
         }
     }
     
-    /* char_offset is beyond the available data */
-    return NULL;
+    entry = aesd_circular_buffer_entry_at(buffer, low);
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_start(buffer, low);
+    return entry;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
+* If the buffer was already full, drops the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry that was dropped, for the caller to free, or NULL if none was
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    /**
-    * TODO: implement per description
-    */
+    const char *dropped = NULL;
+    struct aesd_buffer_entry *entry;
 
-    /* Since we are given the 'full' flag in the structure, we'll implement it
-     * that way as stated in lecture (since we can implement without the `full` flag,
-     * but would waste one index). When the buffer is full, we overwrite the oldest
-     * entry (at out_offs) and advance out_offs.
-     */
-    
-    /* Add the new entry at the in_offs position */
-    buffer->entry[buffer->in_offs] = *add_entry;
-    
-    /* If the buffer was full, we're overwriting the oldest entry
-     * so we need to advance out_offs to the next entry */
+    /* When the buffer is full, the oldest entry (at out_offs) goes first.
+     * With a ring larger than the capacity its slot is not the one written
+     * below, so it is cleared to keep stale pointers out of the ring. */
     if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs & buffer->ring_mask];
+
+        dropped = oldest->buffptr;
+        buffer->base_offset += oldest->size;
+        buffer->total_size -= oldest->size;
+        oldest->buffptr = NULL;
+        oldest->size = 0;
+        buffer->out_offs++;
     }
     
-    /* Advance in_offs to the next position */
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    /* Add the new entry at the in_offs position and advance in_offs. It starts
+     * right after the last byte stored so far. */
+    entry = &buffer->entry[buffer->in_offs & buffer->ring_mask];
+    *entry = *add_entry;
+    entry->offset = buffer->base_offset + buffer->total_size;
+    buffer->total_size += entry->size;
+    buffer->in_offs++;
     
-    /* If in_offs catches up to out_offs after advancing, the buffer is now full */
-    if (buffer->in_offs == buffer->out_offs) {
-        buffer->full = true;
+    /* The buffer is full once it holds capacity entries */
+    buffer->full = aesd_circular_buffer_count(buffer) == buffer->capacity;
+
+    return dropped;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping up to
+* @param capacity entries, between 1 and AESDCHAR_MAX_CAPACITY. The ring is rounded up to a power
+* of two; it is embedded in the structure when small enough, and allocated otherwise.
+* @return 0 on success, -EINVAL for an unsupported capacity, -ENOMEM if the ring could not be allocated
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t ring_size = 1;
+
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY)
+        return -EINVAL;
+
+    while (ring_size < capacity)
+        ring_size <<= 1;
+
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if (ring_size <= AESDCHAR_BUILTIN_RING_SIZE) {
+        buffer->entry = buffer->builtin;
+        ring_size = AESDCHAR_BUILTIN_RING_SIZE;
+    } else {
+        buffer->entry = aesd_ring_alloc(ring_size);
+        if (!buffer->entry)
+            return -ENOMEM;
     }
+
+    buffer->capacity = capacity;
+    buffer->ring_mask = ring_size - 1;
+    return 0;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Frees the ring of @param buffer if it was allocated. The memory referenced by the entries is
+* managed by the caller and must be freed before.
+*/
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry != buffer->builtin)
+        aesd_ring_free(buffer->entry);
+    buffer->entry = NULL;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping the
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED most recent entries. This never allocates.
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
 }
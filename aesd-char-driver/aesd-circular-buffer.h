@@ -16,8 +16,22 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of write operations kept by a buffer set up with aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+/**
+ * Largest capacity accepted by aesd_circular_buffer_init_capacity()
+ */
+#define AESDCHAR_MAX_CAPACITY 65536
+
+/**
+ * Ring slots embedded in struct aesd_circular_buffer, enough for the default
+ * capacity without allocating. Must be a power of two.
+ */
+#define AESDCHAR_BUILTIN_RING_SIZE 16
+
 struct aesd_buffer_entry
 {
     /**
@@ -28,44 +42,130 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte in the stream of every byte ever added to the buffer,
+     * set by aesd_circular_buffer_add_entry(). Only differences between offsets are
+     * meaningful, they stay correct when the stream position wraps.
+     */
+    size_t offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * The ring of ring_mask + 1 entries, a power of two no smaller than capacity.
+     * Points to builtin, or to memory allocated by aesd_circular_buffer_init_capacity()
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Free-running index of the next write. The slot it refers to is
+     * in_offs & ring_mask, which wraps without a division, and the number of
+     * entries is in_offs - out_offs even after the indices themselves wrap.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t in_offs;
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * Free-running index of the oldest entry, the first location to read from
      */
-    uint8_t in_offs;
+    uint32_t out_offs;
     /**
-     * The first location in the entry structure to read from
+     * Maximum number of entries kept, the oldest one is dropped beyond that
      */
-    uint8_t out_offs;
+    uint32_t capacity;
     /**
-     * set to true when the buffer entry structure is full
+     * Ring size minus one
+     */
+    uint32_t ring_mask;
+    /**
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * Stream position of the oldest entry, the offset its first byte is read at is 0
+     */
+    size_t base_offset;
+    /**
+     * Number of bytes in all entries, kept up to date on add and evict
+     */
+    size_t total_size;
+    /**
+     * Ring storage used when capacity fits in it
+     */
+    struct aesd_buffer_entry builtin[AESDCHAR_BUILTIN_RING_SIZE];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
+
+/**
+ * @return the number of entries currently stored in @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->in_offs - buffer->out_offs;
+}
+
+/**
+ * @return the entry @param n positions after the oldest one in @param buffer,
+ * which must be less than aesd_circular_buffer_count()
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t n)
+{
+    return &buffer->entry[(buffer->out_offs + n) & buffer->ring_mask];
+}
+
+/**
+ * @return the number of bytes in all entries of @param buffer, as if concatenated end to end
+ */
+static inline size_t aesd_circular_buffer_total_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+ * @return the stream position of the oldest byte in @param buffer. Adding a zero referenced
+ * character index to it gives a position that keeps naming the same byte after older entries
+ * are dropped, subtracting it again gives the byte's current character index
+ */
+static inline size_t aesd_circular_buffer_base_offset(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->base_offset;
+}
+
+/**
+ * @return the zero referenced character index of the first byte of the entry @param n positions
+ * after the oldest one in @param buffer, if all buffer strings were concatenated end to end
+ */
+static inline size_t aesd_circular_buffer_entry_start(struct aesd_circular_buffer *buffer, uint32_t n)
+{
+    return aesd_circular_buffer_entry_at(buffer, n)->offset - buffer->base_offset;
+}
+
+/**
+ * Evaluates to 0, or fails to compile with a negative array size if @param index is
+ * narrower than the ring indices
+ */
+#define AESD_CIRCULAR_BUFFER_INDEX_CHECK(index) \
+    (0 * sizeof(char[sizeof(index) >= sizeof(uint32_t) ? 1 : -1]))
+
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each entry stored in the circular buffer, oldest first.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index. The
+ * ring indices run freely up to UINT32_MAX, a narrower type such as uint8_t would never
+ * reach in_offs and loop forever, so it fails to compile
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -73,9 +173,10 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=(buffer)->out_offs + AESD_CIRCULAR_BUFFER_INDEX_CHECK(index); \
+            index!=(buffer)->in_offs && \
+            ((entryptr)=&((buffer)->entry[index & (buffer)->ring_mask]), 1); \
+            index++)
 
 
 
@@ -33,14 +33,219 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Metadata of one stored command, filled in by AESDCHAR_IOCGETENTRY and AESDCHAR_IOCGETRANGE
+ */
+struct aesd_entry_info {
+    /**
+     * Number of commands stored on the device before this one, it never changes
+     * and tells whether two calls returned the same command
+     */
+    uint64_t sequence;
+    /**
+     * File position of the first byte of the command, as llseek() and read() see it
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the command, including its newline
+     */
+    uint64_t size;
+};
+
+/**
+ * A structure to be passed by IOCTL to read one command in a single call, like
+ * AESDCHAR_IOCSEEKTO followed by read() but without moving the file position
+ */
+struct aesd_getentry {
+    /**
+     * The zero referenced write command to read, as for struct aesd_seekto
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write to start copying at
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * User space address of the buffer the command is copied to
+     */
+    uint64_t buf;
+    /**
+     * Size of that buffer. The copy stops when it is full, info.size tells the
+     * whole size of the command, 0 just fetches info
+     */
+    uint64_t buf_len;
+    /**
+     * Set to the number of bytes copied to buf
+     */
+    uint64_t copied;
+    /**
+     * Set to the metadata of the command
+     */
+    struct aesd_entry_info info;
+};
+
+/**
+ * A structure to be passed by IOCTL to read consecutive commands in a single call.
+ * Their data is copied back to back to buf, starting at write_cmd_offset in the first
+ */
+struct aesd_getrange {
+    /**
+     * The zero referenced write command of the first command to read
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within that write to start copying at
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Number of commands to read and entries in info. Set to the number of commands
+     * described in info, fewer when the device holds fewer after write_cmd
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * User space address of the buffer the commands are copied to
+     */
+    uint64_t buf;
+    /**
+     * Size of that buffer. The copy stops when it is full, the sizes in info tell
+     * where it stopped
+     */
+    uint64_t buf_len;
+    /**
+     * User space address of an array of count struct aesd_entry_info
+     */
+    uint64_t info;
+    /**
+     * Set to the number of bytes copied to buf
+     */
+    uint64_t copied;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Turn follow mode of an open file on (non-zero) or off (0). In follow mode, read()
+ * at the end of the data waits for the next command instead of returning 0, or fails
+ * with EAGAIN on an O_NONBLOCK file, and picks up where the previous read stopped even
+ * when older commands were dropped meanwhile, like tail -f
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Read a command, or consecutive commands, along with their metadata in a single
+ * call. Both fail with EINVAL when write_cmd is not stored or write_cmd_offset is
+ * beyond its size, like AESDCHAR_IOCSEEKTO
+ */
+#define AESDCHAR_IOCGETENTRY _IOWR(AESD_IOC_MAGIC, 3, struct aesd_getentry)
+#define AESDCHAR_IOCGETRANGE _IOWR(AESD_IOC_MAGIC, 4, struct aesd_getrange)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
+
+/*
+ * Memory maps
+ * mmap() of /dev/aesdchar is read only, and takes one of two offsets:
+ *
+ * AESDCHAR_MMAP_STATUS_PGOFF (offset 0, up to one page) maps the live
+ * struct aesd_mmap_status, which the driver updates for every stored command.
+ *
+ * AESDCHAR_MMAP_SNAPSHOT_PGOFF (offset of one page) maps a copy of the stored
+ * commands taken by the mmap() call, which never changes afterwards. It starts
+ * with a struct aesd_mmap_snapshot, followed by entry_count struct aesd_mmap_entry
+ * oldest first, followed by the data of the entries at data_offset. When the
+ * mapping is too short for all commands, only the oldest that fit are included,
+ * map_size tells the length to map for all of them. The pages of a longer mapping
+ * past map_size are not backed, accessing them raises SIGBUS.
+ *
+ * A snapshot stays valid however many commands are written after it. Comparing
+ * its generation with the one of the status tells whether newer commands exist,
+ * its base_offset with the one of the status whether its oldest commands have
+ * been dropped from the device since.
+ */
+#define AESDCHAR_MMAP_STATUS_PGOFF 0
+#define AESDCHAR_MMAP_SNAPSHOT_PGOFF 1
+
+#define AESDCHAR_MMAP_MAGIC 0x64736561  /* "aesd" in little endian memory */
+
+struct aesd_mmap_status {
+    /**
+     * Odd while the driver updates the fields below. Read it, then the fields, then
+     * read it again: the fields are consistent if it was even and did not change
+     */
+    uint32_t sequence;
+    /**
+     * AESDCHAR_MMAP_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Number of commands ever stored, it goes up by one for each
+     */
+    uint64_t generation;
+    /**
+     * Number of commands currently stored
+     */
+    uint64_t entry_count;
+    /**
+     * Stream position of the oldest stored byte, in the stream of every byte ever
+     * stored. Only differences between stream positions are meaningful
+     */
+    uint64_t base_offset;
+    /**
+     * Number of bytes currently stored, the size read() and llseek() see
+     */
+    uint64_t total_size;
+};
+
+struct aesd_mmap_snapshot {
+    /**
+     * AESDCHAR_MMAP_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Number of commands in this snapshot
+     */
+    uint32_t entry_count;
+    /**
+     * Number of commands the device held, more than entry_count if the mapping was short
+     */
+    uint32_t total_entries;
+    uint32_t reserved;
+    /**
+     * The generation of the status when the snapshot was taken
+     */
+    uint64_t generation;
+    /**
+     * The base_offset of the status when the snapshot was taken
+     */
+    uint64_t base_offset;
+    /**
+     * Offset of the data of the first command from the start of the mapping
+     */
+    uint64_t data_offset;
+    /**
+     * Number of bytes in the commands of this snapshot
+     */
+    uint64_t data_size;
+    /**
+     * Mapping length needed for all commands the device held
+     */
+    uint64_t map_size;
+};
+
+struct aesd_mmap_entry {
+    /**
+     * Offset of the command from data_offset, which is also its position
+     * for read() when the snapshot was taken
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the command, including its newline
+     */
+    uint64_t size;
+};
 
 #endif /* AESD_IOCTL_H */
@@ -24,15 +24,108 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/* Smallest temp buffer allocated for a partial write, it doubles from there */
+#define AESD_TEMP_BUFFER_MIN_SIZE 64
+
+/*
+ * A partial command waiting for its newline
+ */
+struct aesd_temp_buffer
+{
+    char *buffptr;                                 /* aesd_entry_alloc() memory, NULL until needed */
+    size_t size;                                   /* Bytes of the partial command */
+    size_t capacity;                               /* Bytes allocated */
+};
+
+/*
+ * Command memory comes from one of AESD_SIZE_CLASSES slab caches, the smallest
+ * whose objects of AESD_SIZE_CLASS_MIN << class bytes fit it along with its
+ * header, and from kvmalloc() beyond that
+ */
+#define AESD_SIZE_CLASSES 6
+#define AESD_SIZE_CLASS_MIN 64
+#define AESD_SIZE_CLASS_LARGE AESD_SIZE_CLASSES
+
+/* Freed command memory each device keeps per size class for reuse */
+#define AESD_FREE_LIST_MAX 16
+
+/* Most devices the nr_devs module parameter can ask for */
+#define AESD_MAX_DEVS 256
+
+/*
+ * Counters exported under /sys/class/aesdchar_class/aesdcharN/stats/, atomic
+ * so they can be read without the device lock. Only writers update them,
+ * readers stay free of shared cache lines.
+ */
+struct aesd_stats
+{
+    atomic64_t writes;                             /* Successful write() calls */
+    atomic64_t write_bytes;                        /* Bytes they accepted */
+    atomic64_t commands;                           /* Commands stored */
+    atomic64_t dropped;                            /* Commands dropped to make room for newer ones */
+    atomic64_t dropped_bytes;                      /* Bytes of those commands */
+    atomic64_t alloc_slab;                         /* Command memory taken from the size class caches */
+    atomic64_t alloc_large;                        /* Command memory taken from kvmalloc() */
+    atomic64_t alloc_reused;                       /* Command memory taken from the free lists */
+    atomic64_t recycled;                           /* Command memory put on the free lists */
+    atomic64_t frees;                              /* Command memory given back to the allocator */
+};
+
+struct aesd_mmap_status;
+
+/*
+ * Memory behind a stored command. Readers copy out of entries without the
+ * device lock, so an evicted command is only freed once every reader that
+ * may still be copying from it has left its SRCU read section.
+ */
+struct aesd_entry_mem
+{
+    union {
+        struct rcu_head rcu;                       /* Deferred free of an evicted command */
+        struct aesd_entry_mem *next_free;          /* Link in a free list of the device */
+    };
+    struct aesd_dev *dev;                          /* Device whose free list it goes back to */
+    unsigned int size_class;                       /* Its slab cache, or AESD_SIZE_CLASS_LARGE */
+    char data[];
+};
+
+/*
+ * Command memory of one size class waiting to be reused. Filled from SRCU
+ * callbacks as well as writers, hence the spinlock.
+ */
+struct aesd_free_list
+{
+    spinlock_t lock;
+    struct aesd_entry_mem *head;
+    unsigned int count;
+};
 
 struct aesd_dev
 {
     struct cdev cdev;                              /* Char device structure */
     struct aesd_circular_buffer circular_buffer;   /* Circular buffer for storing write commands */
-    struct mutex lock;                             /* Mutex for thread-safe access */
-    char *temp_buffer;                             /* Buffer to temporarily store incoming, incomplete writes */
-    size_t temp_buffer_size;                       /* Current size of temp buffer */
+    struct mutex lock;                             /* Serializes writers */
+    seqcount_mutex_t seq;                          /* Lets lockless readers detect circular buffer updates */
+    struct srcu_struct srcu;                       /* Keeps entries alive while readers copy from them */
+    struct aesd_temp_buffer leftover;              /* Partial command of files closed before its newline */
+    wait_queue_head_t wait;                        /* Woken for every command stored */
+    struct aesd_mmap_status *status;               /* Page mapped at AESDCHAR_MMAP_STATUS_PGOFF */
+    struct aesd_stats stats;                       /* Counters shown in sysfs */
+    struct aesd_free_list free_lists[AESD_SIZE_CLASSES]; /* Command memory for reuse, per size class */
+
+};
 
+/*
+ * State of one open file of the device, kept in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;                          /* Device the file was opened on */
+    struct mutex write_lock;                       /* Serializes writes through this file */
+    struct aesd_temp_buffer temp_buffer;           /* Incoming, incomplete write of this file */
+    bool follow;                                   /* Set by AESDCHAR_IOCFOLLOW, read() waits for data at the end */
+    size_t follow_pos;                             /* Stream position the next follow read starts at */
+    loff_t follow_fpos;                            /* f_pos follow_pos goes with, any other f_pos means a seek */
 };
 
 
@@ -20,18 +20,56 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h> // copy_to_user, copy_from_user
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/device.h>
+#include <linux/atomic.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+#define AESD_CLASS_NAME "aesdchar_class"
+
+/* Number of write commands kept by each device */
+static unsigned int capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Number of write commands kept (1 to 65536, default 10)");
+
+/* Number of independent devices, /dev/aesdchar0 and up */
+static unsigned int nr_devs = 1;
+module_param(nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devs, "Number of aesdchar devices, each with its own buffer and lock (1 to 256, default 1)");
+
 MODULE_AUTHOR("Scott Karl");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+/* nr_devs devices, device i having minor aesd_minor + i */
+static struct aesd_dev *aesd_devices;
+static struct class *aesd_class;
+
+/* Slab caches for command memory, shared by all devices */
+static struct kmem_cache *aesd_entry_caches[AESD_SIZE_CLASSES];
+static const char * const aesd_entry_cache_names[AESD_SIZE_CLASSES] = {
+    "aesdchar_entry_64",
+    "aesdchar_entry_128",
+    "aesdchar_entry_256",
+    "aesdchar_entry_512",
+    "aesdchar_entry_1024",
+    "aesdchar_entry_2048",
+};
 
 /* Forward declarations */
 static size_t aesd_get_total_size(struct aesd_dev *dev);
+static int aesd_temp_buffer_reserve(struct aesd_dev *dev, struct aesd_temp_buffer *temp,
+                size_t count, gfp_t gfp);
+static void aesd_entry_free(const char *buffptr);
 
 /**
  * aesd_open() - Device open operation handler
@@ -46,33 +84,60 @@ static size_t aesd_get_total_size(struct aesd_dev *dev);
  *        The file struct represents AN OPEN INSTANCE of the file - one per open() call.
  *        It tracks the current file position (f_pos), access mode (read/write), and
  *        other per-open state. Multiple opens create multiple file structs, all pointing
- *        to the same inode. We use filp->private_data to store our device pointer.
+ *        to the same inode. We use filp->private_data to store our per-file state.
  *        Think of it as: MULTIPLE file structs (one per open) → ONE inode (the file).
  *
  * This function is invoked by the kernel whenever a process opens the /dev/aesdchar
  * device file. It is called for each open() system call, including multiple opens
  * by the same or different processes. The function retrieves the device-specific
- * structure and stores it in the file's private_data field for efficient access
- * during subsequent read/write operations. Multiple processes can open the device
- * simultaneously, each receiving their own file pointer but sharing the underlying
- * device structure protected by a mutex.
+ * structure and stores it, along with the state of this open file, in the file's
+ * private_data field for efficient access during subsequent read/write operations.
+ * Multiple processes can open the device simultaneously, each receiving their own
+ * file pointer but sharing the underlying device structure protected by a mutex.
+ *
+ * Partial writes are collected per open file. A file opened for writing takes
+ * over the partial command the last writer closed the device with, so
+ * echo -n "abc" > /dev/aesdchar; echo "def" > /dev/aesdchar still stores "abcdef\n".
+ *
+ * Return: 0 on success, -ENOMEM if the per-file state could not be allocated,
+ *         -ERESTARTSYS if interrupted
  */
 int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev *dev;
+    struct aesd_file *file;
     
     PDEBUG("open");
 
     /* Get our device structure from the inode's cdev using container_of macro.
      * inode->i_cdev points to the cdev we registered in aesd_setup_cdev().
      * container_of() navigates from the cdev member back to the containing aesd_dev.
-     * This is best practice even though aesd_device is global. */
+     * This picks the one of the aesd_devices the node was opened for. */
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
     
-    /* Save device pointer in filp->private_data for quick access in read/write.
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->dev = dev;
+    mutex_init(&file->write_lock);
+    
+    if (filp->f_mode & FMODE_WRITE) {
+        if (mutex_lock_interruptible(&dev->lock)) {
+            kfree(file);
+            return -ERESTARTSYS;
+        }
+        swap(file->temp_buffer, dev->leftover);
+        mutex_unlock(&dev->lock);
+    }
+    
+    /* read_iter and write_iter honour IOCB_NOWAIT, let io_uring pass it */
+    filp->f_mode |= FMODE_NOWAIT;
+    
+    /* Save the per-file state in filp->private_data for quick access in read/write.
      * Each open file instance (filp) gets its own private_data, but they all
      * point to the same shared device structure (dev). */
-    filp->private_data = dev;
+    filp->private_data = file;
     
     return 0;
 }
@@ -86,260 +151,781 @@ int aesd_open(struct inode *inode, struct file *filp)
  * is closed. It is called when a process closes the file descriptor via close(),
  * or when a process terminates and the kernel closes all open descriptors. Note
  * that if a file descriptor is duplicated (via dup(), fork(), etc.), release() is
- * only called when all duplicates are closed. For this driver, no cleanup is
- * required as the device and its circular buffer persist across open/close cycles.
+ * only called when all duplicates are closed. Only the per-file state allocated
+ * in aesd_open() is freed, the device and its circular buffer persist across
+ * open/close cycles. A partial command the file was collecting is left to the
+ * device, for the next file opened for writing to complete.
  */
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_temp_buffer *leftover = &dev->leftover;
+    
     PDEBUG("release");
     
-    /* No cleanup needed for our driver - the device and its buffers
-     * persist across open/close and are only freed during module unload */
+    if (file->temp_buffer.size > 0) {
+        mutex_lock(&dev->lock);
+        if (leftover->size == 0) {
+            swap(file->temp_buffer, *leftover);
+        } else if (!aesd_temp_buffer_reserve(dev, leftover, file->temp_buffer.size, GFP_KERNEL)) {
+            /* Several files closed with partial commands, keep them in close order */
+            memcpy(leftover->buffptr + leftover->size, file->temp_buffer.buffptr,
+                   file->temp_buffer.size);
+            leftover->size += file->temp_buffer.size;
+        } else {
+            printk(KERN_WARNING "aesdchar: dropping %zu byte partial command\n",
+                   file->temp_buffer.size);
+        }
+        mutex_unlock(&dev->lock);
+    }
+    
+    /* The device and its buffers persist across open/close and are only
+     * freed during module unload */
+    aesd_entry_free(file->temp_buffer.buffptr);
+    mutex_destroy(&file->write_lock);
+    kfree(file);
     
     return 0;
 }
 
 /**
- * aesd_read() - Read data from the device
- * @filp: File pointer for the open device instance
- * @buf: User-space buffer to copy data into
- * @count: Maximum number of bytes to read
- * @f_pos: Pointer to current file position (USED and updated to track read position).
- *         The kernel VFS passes &filp->f_pos as this parameter, not userspace.
- *         When userspace calls read(fd, buf, count), the VFS translates fd to filp
- *         and calls aesd_read(filp, buf, count, &filp->f_pos). Modifying *f_pos
- *         updates filp->f_pos, persisting across calls to support sequential reads.
- *
- * Reads data from the circular buffer containing the most recent 10 write commands.
+ * aesd_find_entry() - Look up the entry holding a stream position without the device lock
+ * @dev: Pointer to device structure
+ * @stream_pos: Position of the byte in the stream of every byte ever written
+ * @anchor: When non-NULL, the character index *anchor is turned into a stream
+ *          position first and stored in *@stream_pos, within the same snapshot
+ * @entry: Filled with a copy of the entry holding the byte
+ * @entry_offset: Filled with the offset of the byte in that entry
+ *
+ * Entries never change once added, and the stream position of a byte stays the
+ * same until its entry is dropped, so whatever this returns stays valid data for
+ * that position. The lookup is retried until no writer updated the circular buffer
+ * meanwhile. The caller must be in an SRCU read section to use @entry->buffptr.
+ *
+ * Return: true if the byte is stored, false if it was dropped or not written yet
+ */
+static bool aesd_find_entry(struct aesd_dev *dev, size_t *stream_pos, const loff_t *anchor,
+                struct aesd_buffer_entry *entry, size_t *entry_offset)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    struct aesd_buffer_entry *found;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        if (anchor) {
+            *stream_pos = aesd_circular_buffer_base_offset(buffer) + *anchor;
+        }
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+                    *stream_pos - aesd_circular_buffer_base_offset(buffer), entry_offset);
+        if (found) {
+            *entry = *found;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return found != NULL;
+}
+
+/**
+ * aesd_stream_range() - Stream positions of the data the device holds
+ * @dev: Pointer to device structure
+ * @base: Filled with the stream position of the oldest byte
+ *
+ * Return: The stream position the next command will be stored at
+ */
+static size_t aesd_stream_range(struct aesd_dev *dev, size_t *base)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    size_t end;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        *base = aesd_circular_buffer_base_offset(buffer);
+        end = *base + aesd_circular_buffer_total_size(buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return end;
+}
+
+/**
+ * aesd_file_stream_pos() - Stream position the next read of a file starts at
+ * @file: The open file
+ * @f_pos: Its current file position
+ * @base: Stream position of the oldest byte, from aesd_stream_range()
+ * @end: Stream position after the newest byte, from aesd_stream_range()
+ *
+ * A file in follow mode continues where its last read stopped, unless it was
+ * seeked since. When what it was about to read has been dropped meanwhile, it
+ * continues with the oldest command left. Other files read at their f_pos,
+ * which counts from the oldest byte and so moves over the data as commands
+ * are dropped.
+ *
+ * Return: A stream position from @base to @end
+ */
+static size_t aesd_file_stream_pos(struct aesd_file *file, loff_t f_pos, size_t base, size_t end)
+{
+    size_t total_size = end - base;
+
+    if (file->follow && f_pos == file->follow_fpos) {
+        return file->follow_pos - base > total_size ? base : file->follow_pos;
+    }
+    return base + min_t(size_t, f_pos, total_size);
+}
+
+/**
+ * aesd_follow_wait() - Wait for data to read at the position of a follow mode file
+ * @iocb: The read request, of a follow mode file
+ * @stream_pos: Filled with the stream position to read from
+ *
+ * Called without an SRCU read section, so a reader waiting for data for a long
+ * time does not hold up the freeing of dropped commands.
+ *
+ * Return: 0 once there is data, -EAGAIN without data for an O_NONBLOCK file or
+ *         an IOCB_NOWAIT request, -ERESTARTSYS if interrupted by a signal while waiting
+ */
+static int aesd_follow_wait(struct kiocb *iocb, size_t *stream_pos)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t base;
+    size_t end;
+
+    end = aesd_stream_range(dev, &base);
+    *stream_pos = aesd_file_stream_pos(file, iocb->ki_pos, base, end);
+    if (*stream_pos != end) {
+        return 0;
+    }
+    if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+        return -EAGAIN;
+    }
+
+    /* Every stored command moves the end of the stream, even when dropping
+     * the oldest one leaves the total size as it was */
+    if (wait_event_interruptible(dev->wait, aesd_stream_range(dev, &base) != end)) {
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/**
+ * aesd_read_iter() - Read data from the device
+ * @iocb: The I/O request. iocb->ki_filp is the file pointer for the open device
+ *        instance, and iocb->ki_pos its file position (USED and updated to track
+ *        read position). When userspace calls read(fd, buf, count), the VFS
+ *        translates fd to filp, copies filp->f_pos into ki_pos and stores it back
+ *        after we return, persisting across calls to support sequential reads.
+ * @to: Destination of the data, whose size is the maximum number of bytes to read.
+ *      A user buffer for read() and readv(), pipe pages for splice() and sendfile().
+ *
+ * Reads data from the circular buffer containing the most recent write commands
+ * (10 unless set with the capacity module parameter).
  * The function uses the file position to determine which entry and offset within
- * that entry to read from, honoring the count parameter by returning at most count
- * bytes. After each successful read, f_pos is advanced by the number of bytes read,
- * allowing subsequent reads to continue from where the previous read left off.
- * Multiple reads may be required to retrieve all data. The function is thread-safe,
- * using a mutex to protect the circular buffer during read operations.
+ * that entry to start reading from, then keeps copying across consecutive entries
+ * until count bytes have been read or the buffered data ends. After each successful
+ * read, f_pos is advanced by the number of bytes read, allowing subsequent reads to
+ * continue from where the previous read left off.
  *
  * The circular buffer stores write commands as complete entries (terminated by newline).
- * This function allows reading across multiple entries, treating them as a contiguous
- * stream of data. When the file position reaches the end of available data, the
- * function returns 0 to indicate EOF.
+ * This function treats them as a contiguous stream of data, so a reader with a large
+ * enough buffer gets the whole history in one call instead of one call per entry.
+ * When the file position reaches the end of available data, the function returns 0
+ * to indicate EOF, unless the file is in follow mode (AESDCHAR_IOCFOLLOW): then it
+ * waits for the next command, or fails with -EAGAIN for O_NONBLOCK.
+ *
+ * Readers never take the device mutex. Each entry is looked up under the seqcount
+ * writers bump around circular buffer updates, and copied out inside an SRCU read
+ * section that keeps it from being freed, so readers run in parallel with each other
+ * and a large copy to userspace never holds up a writer. If writers drop entries
+ * while a read is in progress, the read stops short at the first dropped one.
  *
  * Example: cat /dev/aesdchar will call read() repeatedly with increasing f_pos until
  * it receives 0 (EOF), allowing it to retrieve all buffered data sequentially.
  *
- * Return: Number of bytes read on success, 0 on EOF, -ERESTARTSYS if interrupted,
- *         -EFAULT if copy_to_user fails
+ * The entries are copied into the iov_iter directly, so readv() scatters them into
+ * as many user buffers as it is given. Only a follow mode read ever waits, which an
+ * IOCB_NOWAIT request (io_uring) avoids by failing with -EAGAIN instead.
+ *
+ * Because the data goes through an iov_iter, .splice_read is copy_splice_read(),
+ * which reads straight into pipe pages. sendfile() and splice() from the device to
+ * a socket then move the data without a copy through a user buffer.
+ *
+ * Return: Number of bytes read on success, 0 on EOF,
+ *         -EFAULT if the copy fails before any byte was copied,
+ *         -EAGAIN or -ERESTARTSYS for a follow mode file, see aesd_follow_wait()
  */
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry *entry;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry entry;
+    loff_t *f_pos = &iocb->ki_pos;
+    const loff_t *anchor = f_pos;
+    size_t count = iov_iter_count(to);
+    bool follow = file->follow && count > 0;
+    size_t stream_pos;
     size_t entry_offset;
     size_t bytes_to_copy;
+    size_t copied;
+    size_t base;
+    size_t end;
+    int srcu_idx;
     
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
     
-    /* Acquire mutex lock for thread-safe access to circular buffer */
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;  /* Interrupted by signal - kernel will retry */
+again:
+    /* A follow mode file knows its stream position already, and waits for data there */
+    if (follow) {
+        int err = aesd_follow_wait(iocb, &stream_pos);
+        if (err) {
+            return err;
+        }
+        anchor = NULL;
     }
     
+    srcu_idx = srcu_read_lock(&dev->srcu);
+    
     /* Find which circular buffer entry contains data at the current file position.
-     * This function treats all entries as a contiguous stream of bytes and returns:
-     * - entry: pointer to the buffer entry containing data at f_pos
-     * - entry_offset: byte offset within that entry where f_pos points
-     * Example: If entry[0] has 10 bytes and f_pos=15, this returns entry[1] with offset=5
-     * Returns NULL if f_pos is beyond all available data. */
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buffer, *f_pos, &entry_offset);
-    
-    if (entry == NULL) {
-        /* No data available at current file position - we've read everything.
-         * Returning 0 signals EOF to userspace (standard Unix convention).
-         * Tools like cat recognize this and stop reading. */
-        mutex_unlock(&dev->lock);
-        return 0;
+     * The first lookup also turns f_pos into a stream position, which keeps naming
+     * the same byte when older entries are dropped, so the entries after it are
+     * found even if the buffer changes between them.
+     * Example: If the oldest entry has 10 bytes and f_pos=15, this finds the next
+     * entry with offset=5. Nothing is found if f_pos is beyond all available data,
+     * in which case we return 0 to signal EOF (standard Unix convention). */
+    while (count > 0 && aesd_find_entry(dev, &stream_pos, retval == 0 ? anchor : NULL,
+                &entry, &entry_offset)) {
+        /* Copy the rest of this entry, or as much of it as userspace still has room for */
+        bytes_to_copy = min(entry.size - entry_offset, count);
+        
+        /* Copy data from kernel space (entry.buffptr) to the destination (to).
+         * copy_to_iter() uses copy_to_user() for a userspace buffer, since the kernel
+         * cannot directly write to userspace memory: it performs the necessary access
+         * checks and handles page faults if the buffer is swapped out. It advances the
+         * iterator and returns the number of bytes it copied. */
+        copied = copy_to_iter(entry.buffptr + entry_offset, bytes_to_copy, to);
+        retval += copied;
+        if (copied != bytes_to_copy) {
+            /* Bad userspace address. Report what made it across, if anything did,
+             * the way read() does for a fault part way through the buffer. */
+            if (retval == 0) {
+                retval = -EFAULT;
+            }
+            break;
+        }
+        
+        count -= bytes_to_copy;
+        stream_pos += bytes_to_copy;
     }
     
-    /* Calculate how many bytes we can copy from this entry.
-     * We can only read up to the end of the current entry (entry->size - entry_offset).
-     * If userspace requested more bytes (count) than available in this entry,
-     * they'll need to call read() again to get the rest from the next entry.
-     * This is how sequential reads work - one entry (or partial entry) at a time. */
-    bytes_to_copy = entry->size - entry_offset;
-    if (bytes_to_copy > count) {
-        bytes_to_copy = count;  /* Honor userspace's requested limit */
-    }
-    
-    /* Copy data from kernel space (entry->buffptr) to userspace buffer (buf).
-     * copy_to_user() is required because kernel cannot directly write to userspace memory.
-     * It performs necessary access checks and handles page faults if userspace buffer
-     * is swapped out. Returns non-zero on failure (bad userspace address).
-     * The offset (entry_offset) ensures we start reading from the correct position
-     * within the entry, not always from the beginning. */
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_copy)) {
-        retval = -EFAULT;  /* Bad userspace address */
-        mutex_unlock(&dev->lock);
+    srcu_read_unlock(&dev->srcu, srcu_idx);
+    
+    if (follow) {
+        /* The data waited for was dropped before it could be read, wait again */
+        if (retval == 0) {
+            goto again;
+        }
+        
+        /* Remember where to continue, and point f_pos at the same byte */
+        if (retval > 0) {
+            end = aesd_stream_range(dev, &base);
+            file->follow_pos = stream_pos;
+            *f_pos = stream_pos - base > end - base ? 0 : stream_pos - base;
+            file->follow_fpos = *f_pos;
+        }
         return retval;
     }
     
     /* Update file position to reflect bytes we just read.
      * Next read() call will start from this new position, allowing sequential reads.
      * Example: Read 10 bytes at f_pos=0 → f_pos becomes 10 → next read starts at 10. */
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
+    if (retval > 0) {
+        *f_pos += retval;
+    }
     
-    /* Release mutex and return number of bytes successfully read.
-     * Userspace expects read() to return the actual number of bytes transferred,
-     * which may be less than requested if we hit entry boundaries or EOF. */
-    mutex_unlock(&dev->lock);
+    /* Userspace expects read() to return the actual number of bytes transferred,
+     * which is less than requested only when the buffered data ends first. */
     return retval;
 }
 
 /**
- * aesd_write() - Write data to the device
- * @filp: File pointer for the open device instance
- * @buf: User-space buffer containing data to write
- * @count: Number of bytes to write from the buffer
- * @f_pos: Pointer to current file position (updated after write to reflect new position)
+ * aesd_size_class() - Size class of command memory
+ * @size: Bytes needed, header included
+ *
+ * Return: The smallest size class holding @size bytes, AESD_SIZE_CLASS_LARGE if none does
+ */
+static unsigned int aesd_size_class(size_t size)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_SIZE_CLASSES; size_class++) {
+        if (size <= (AESD_SIZE_CLASS_MIN << size_class)) {
+            break;
+        }
+    }
+    return size_class;
+}
+
+/**
+ * aesd_entry_alloc() - Allocate memory for a command
+ * @dev: Pointer to device structure, whose free lists are tried first
+ * @size: Number of bytes the command needs
+ * @gfp: Allocation flags, GFP_NOWAIT for an IOCB_NOWAIT write
+ *
+ * Commands carry a hidden header for their deferred free, see struct aesd_entry_mem.
+ * Small commands come from the free list of their size class, which evicted commands
+ * of the same class refill, so a steady stream of writes allocates nothing new once
+ * warmed up. When the list is empty they come from the dedicated slab cache of the
+ * class. kvmalloc() builds large commands from order-0 pages mapped together with
+ * vmalloc when physically contiguous memory is short, so a long record never waits
+ * on or fails a high-order allocation. The pages are contiguous in the kernel address
+ * space either way, readers copy across their boundaries without noticing. Without
+ * GFP_KERNEL in @gfp only the slab is tried.
+ *
+ * Return: The command memory, NULL if out of memory
+ */
+static char *aesd_entry_alloc(struct aesd_dev *dev, size_t size, gfp_t gfp)
+{
+    struct aesd_entry_mem *mem;
+    size_t total_size = struct_size(mem, data, size);
+    unsigned int size_class = aesd_size_class(total_size);
+    struct aesd_free_list *free_list;
+
+    if (size_class == AESD_SIZE_CLASS_LARGE) {
+        mem = kvmalloc(total_size, gfp);
+        if (!mem) {
+            return NULL;
+        }
+        atomic64_inc(&dev->stats.alloc_large);
+    } else {
+        free_list = &dev->free_lists[size_class];
+        spin_lock_bh(&free_list->lock);
+        mem = free_list->head;
+        if (mem) {
+            free_list->head = mem->next_free;
+            free_list->count--;
+        }
+        spin_unlock_bh(&free_list->lock);
+        if (mem) {
+            atomic64_inc(&dev->stats.alloc_reused);
+            return mem->data;
+        }
+
+        mem = kmem_cache_alloc(aesd_entry_caches[size_class], gfp);
+        if (!mem) {
+            return NULL;
+        }
+        atomic64_inc(&dev->stats.alloc_slab);
+    }
+
+    mem->dev = dev;
+    mem->size_class = size_class;
+    return mem->data;
+}
+
+/**
+ * aesd_entry_put() - Recycle or free command memory no reader can see
+ * @mem: Command memory from aesd_entry_alloc()
+ *
+ * Memory of a size class goes onto the free list of its device while that has
+ * room, and back to the slab cache otherwise. Called from SRCU callbacks too.
+ */
+static void aesd_entry_put(struct aesd_entry_mem *mem)
+{
+    struct aesd_dev *dev = mem->dev;
+    struct aesd_free_list *free_list;
+    bool recycled = false;
+
+    if (mem->size_class == AESD_SIZE_CLASS_LARGE) {
+        kvfree(mem);
+        atomic64_inc(&dev->stats.frees);
+        return;
+    }
+
+    free_list = &dev->free_lists[mem->size_class];
+    spin_lock_bh(&free_list->lock);
+    if (free_list->count < AESD_FREE_LIST_MAX) {
+        mem->next_free = free_list->head;
+        free_list->head = mem;
+        free_list->count++;
+        recycled = true;
+    }
+    spin_unlock_bh(&free_list->lock);
+
+    if (recycled) {
+        atomic64_inc(&dev->stats.recycled);
+    } else {
+        kmem_cache_free(aesd_entry_caches[mem->size_class], mem);
+        atomic64_inc(&dev->stats.frees);
+    }
+}
+
+/**
+ * aesd_entry_free() - Free command memory no reader can see
+ * @buffptr: Command memory from aesd_entry_alloc(), or NULL
+ */
+static void aesd_entry_free(const char *buffptr)
+{
+    if (buffptr) {
+        aesd_entry_put(container_of(buffptr, struct aesd_entry_mem, data[0]));
+    }
+}
+
+static void aesd_entry_free_rcu(struct rcu_head *rcu)
+{
+    aesd_entry_put(container_of(rcu, struct aesd_entry_mem, rcu));
+}
+
+/**
+ * aesd_free_lists_drain() - Give the memory on the free lists of a device back
+ * @dev: Pointer to device structure, with no SRCU callbacks pending
+ */
+static void aesd_free_lists_drain(struct aesd_dev *dev)
+{
+    struct aesd_entry_mem *mem;
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_SIZE_CLASSES; size_class++) {
+        while ((mem = dev->free_lists[size_class].head) != NULL) {
+            dev->free_lists[size_class].head = mem->next_free;
+            kmem_cache_free(aesd_entry_caches[size_class], mem);
+        }
+        dev->free_lists[size_class].count = 0;
+    }
+}
+
+/**
+ * aesd_entry_caches_create() - Create the slab caches of the size classes
+ *
+ * Readers and writers copy command data from and to user space, so the data
+ * part of the objects is whitelisted for hardened usercopy.
+ *
+ * Return: 0 on success, -ENOMEM with no cache left on failure
+ */
+static int aesd_entry_caches_create(void)
+{
+    unsigned int size_class;
+    unsigned int object_size;
+    unsigned int data_offset = offsetof(struct aesd_entry_mem, data);
+
+    for (size_class = 0; size_class < AESD_SIZE_CLASSES; size_class++) {
+        object_size = AESD_SIZE_CLASS_MIN << size_class;
+        aesd_entry_caches[size_class] = kmem_cache_create_usercopy(
+                    aesd_entry_cache_names[size_class], object_size, 0, 0,
+                    data_offset, object_size - data_offset, NULL);
+        if (!aesd_entry_caches[size_class]) {
+            while (size_class-- > 0) {
+                kmem_cache_destroy(aesd_entry_caches[size_class]);
+            }
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void aesd_entry_caches_destroy(void)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_SIZE_CLASSES; size_class++) {
+        kmem_cache_destroy(aesd_entry_caches[size_class]);
+    }
+}
+
+/**
+ * aesd_temp_buffer_reserve() - Make room for more partial write data
+ * @dev: Pointer to device structure
+ * @temp: The temp buffer of a file, or the leftover of the device
+ * @count: Number of bytes about to be appended to it
+ * @gfp: Allocation flags, see aesd_entry_alloc()
+ *
+ * Grows the buffer to at least twice its capacity whenever it runs out of
+ * room, so a command assembled from n bytes of small writes is reallocated
+ * O(log n) times and its bytes are moved O(n) times in total, instead of the
+ * whole command being copied again on every write. The price is up to half
+ * of the buffer being unused once the command is complete.
+ *
+ * Caller must hold the lock of the buffer: the file's write_lock, or the device lock.
+ *
+ * Return: 0 on success, -ENOMEM if the buffer could not grow (it is left as is)
+ */
+static int aesd_temp_buffer_reserve(struct aesd_dev *dev, struct aesd_temp_buffer *temp,
+                size_t count, gfp_t gfp)
+{
+    size_t needed = temp->size + count;
+    size_t capacity;
+    char *new_buffer;
+
+    if (needed < count)
+        return -ENOMEM;  /* Size overflow */
+    if (needed <= temp->capacity)
+        return 0;
+
+    capacity = max3(needed, 2 * temp->capacity, (size_t)AESD_TEMP_BUFFER_MIN_SIZE);
+
+    new_buffer = aesd_entry_alloc(dev, capacity, gfp);
+    if (!new_buffer)
+        return -ENOMEM;
+
+    /* Keep the partial command, like krealloc() would */
+    if (temp->size > 0)
+        memcpy(new_buffer, temp->buffptr, temp->size);
+    aesd_entry_free(temp->buffptr);
+
+    temp->buffptr = new_buffer;
+    temp->capacity = capacity;
+    return 0;
+}
+
+/**
+ * aesd_status_update() - Publish a new command on the status page
+ * @dev: Pointer to device structure
+ *
+ * User space can't use the kernel seqcount, so the page carries its own
+ * sequence number, odd while the fields change. The generation is only ever
+ * changed here, and read by the snapshot under the seqcount.
+ * Caller must hold the device lock, in a write_seqcount section.
+ */
+static void aesd_status_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_status *status = dev->status;
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+
+    WRITE_ONCE(status->sequence, status->sequence + 1);
+    smp_wmb();
+    WRITE_ONCE(status->generation, status->generation + 1);
+    WRITE_ONCE(status->entry_count, aesd_circular_buffer_count(buffer));
+    WRITE_ONCE(status->base_offset, aesd_circular_buffer_base_offset(buffer));
+    WRITE_ONCE(status->total_size, aesd_circular_buffer_total_size(buffer));
+    smp_wmb();
+    WRITE_ONCE(status->sequence, status->sequence + 1);
+}
+
+/**
+ * aesd_add_entry() - Store a complete command in the circular buffer
+ * @dev: Pointer to device structure
+ * @buffptr: Command from aesd_entry_alloc(), owned by the circular buffer from here on
+ * @size: Length of the command including its newline
+ *
+ * Drops the oldest command when the buffer is full. Its memory is freed once
+ * the readers that may still be copying from it are done, without waiting for them.
+ * Wakes the readers waiting for data, in follow mode read() or in poll(), and
+ * updates the status page mapped by aesd_mmap().
+ * Caller must hold the device lock.
+ */
+static void aesd_add_entry(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry new_entry;
+    const char *old_entry_ptr;
+    size_t old_total_size = aesd_circular_buffer_total_size(&dev->circular_buffer);
+
+    /* Prepare new entry with pointer and size. The circular buffer stores these
+     * values but doesn't own the memory - we're responsible for allocation/deallocation. */
+    new_entry.buffptr = buffptr;
+    new_entry.size = size;
+
+    /* Add to circular buffer. aesd_circular_buffer_add_entry() handles all the
+     * circular buffer logic (advancing in_offs, out_offs, managing full flag), but
+     * it does NOT manage memory! Per the function's contract: "memory lifetime
+     * managed by the caller". When the buffer was full, it hands back the oldest
+     * entry it dropped. */
+    write_seqcount_begin(&dev->seq);
+    old_entry_ptr = aesd_circular_buffer_add_entry(&dev->circular_buffer, &new_entry);
+    aesd_status_update(dev);
+    write_seqcount_end(&dev->seq);
+
+    atomic64_inc(&dev->stats.commands);
+    
+    /* Now free the old memory that was overwritten, after the grace period */
+    if (old_entry_ptr) {
+        atomic64_inc(&dev->stats.dropped);
+        atomic64_add(old_total_size + size - aesd_circular_buffer_total_size(&dev->circular_buffer),
+                     &dev->stats.dropped_bytes);
+        call_srcu(&dev->srcu, &container_of(old_entry_ptr, struct aesd_entry_mem, data[0])->rcu,
+                  aesd_entry_free_rcu);
+    }
+
+    wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/**
+ * aesd_write_iter() - Write data to the device
+ * @iocb: The I/O request, for the file pointer of the open device instance
+ *        (iocb->ki_filp) and its file position (iocb->ki_pos, updated after
+ *        write to reflect new position)
+ * @from: Source of the data, whose size is the number of bytes to write.
+ *        All segments of a writev() are written as one.
  *
  * Accepts write data from user space and stores it in a circular buffer after a
  * complete command (terminated by newline) is received. The function accumulates
- * partial writes in a temporary buffer until a newline character is encountered.
- * Once a newline is found, the complete command is added to the circular buffer
- * which maintains the most recent 10 commands.
+ * partial writes in a temporary buffer of the open file until a newline character
+ * is encountered, so writers using their own open file never mix their partial
+ * commands, and each command is stored whole when its newline arrives.
+ * Every newline completes a command, which is added to the circular buffer
+ * which maintains the most recent commands (10 by default, see capacity).
  *
  * Write behavior:
  * - Data without '\n': temp in temp_buffer for future writes to complete
- * - Data with '\n': Complete command added to circular buffer, temp_buffer reset
+ * - Data with '\n': Each newline-terminated command becomes its own entry, so
+ *   "a\nb\nc" stores "a\n" and "b\n" and keeps "c" in temp_buffer
  * - Circular buffer full: Oldest entry is automatically freed when new entry added
- * - Memory allocation: Uses kmalloc with GFP_KERNEL flag for each complete command
+ * - Memory allocation: temp_buffer grows geometrically, so assembling a command from
+ *   many small writes costs time linear in its size. When the write ends with the
+ *   only newline in temp_buffer, the buffer itself becomes the entry without being
+ *   copied; otherwise each command is duplicated into an exactly sized entry
  *
- * The function is thread-safe, using a mutex to ensure atomic write operations.
- * Multiple processes can write simultaneously, but each write completes fully
- * before the next begins.
+ * The data is copied from user space once, in bulk, and searched for newlines
+ * with memchr(). A writev() of N commands thus stores N entries under one
+ * acquisition of the mutex.
+ *
+ * The function is thread-safe. The write_lock of the file keeps writes through
+ * the same file in order, and the device mutex is only taken to store complete
+ * commands, after the data has been copied from user space. Multiple processes
+ * can write simultaneously, each command being stored at once. Readers do not take
+ * the mutex and never delay a write.
+ *
+ * An IOCB_NOWAIT request (io_uring) does not wait for the mutexes or for memory
+ * to be reclaimed, and fails with -EAGAIN instead.
  *
  * Return: Number of bytes written on success, -ENOMEM on allocation failure,
- *         -ERESTARTSYS if interrupted, -EFAULT if copy_from_user fails
+ *         -ERESTARTSYS if interrupted, -EFAULT if the copy from user space fails,
+ *         -EAGAIN for an IOCB_NOWAIT request that would have to wait. If memory
+ *         runs out after some commands were stored, the count up to the end of the
+ *         last stored command is returned and the rest can be written again.
  */
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    ssize_t retval = -ENOMEM;
-    struct aesd_dev *dev = filp->private_data;
-    char *new_buffer;
-    size_t i;
-    bool found_newline = false;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_temp_buffer *temp = &file->temp_buffer;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    gfp_t gfp = nowait ? GFP_NOWAIT : GFP_KERNEL;
+    int nomem = nowait ? -EAGAIN : -ENOMEM;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    ssize_t retval = count;
+    size_t old_size;
+    size_t start = 0;    /* Start of the first command not yet stored */
+    size_t scan;         /* Where the newline search continues */
+    char *data;
+    char *newline;
     
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     
-    /* Acquire mutex lock to ensure thread-safe access to device structures.
+    /* Acquire the write lock of the file to keep writes through it in order.
      * mutex_lock_interruptible() allows the operation to be interrupted by signals,
      * which is important for userspace applications that may want to cancel I/O.
      * Returns non-zero if interrupted by a signal. */
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;  /* Tell kernel to restart syscall after signal handled */
-    }
-    
-    /* Scan incoming data for newline character to determine if this write
-     * completes a command. We need to check this BEFORE allocating memory
-     * so we know whether to add the data to the circular buffer or not.
-     * get_user() safely reads one byte from userspace memory. */
-    for (i = 0; i < count; i++) {
-        char c;
-        if (get_user(c, buf + i)) {
-            mutex_unlock(&dev->lock);
-            return -EFAULT;  /* Bad address - userspace buffer was invalid */
-        }
-        if (c == '\n') {
-            found_newline = true;
-            break;  /* Found terminator, no need to scan further */
+    if (nowait) {
+        if (!mutex_trylock(&file->write_lock)) {
+            return -EAGAIN;  /* Another write holds it, io_uring retries from a worker */
         }
+    } else if (mutex_lock_interruptible(&file->write_lock)) {
+        return -ERESTARTSYS;  /* Tell kernel to restart syscall after signal handled */
     }
     
-    /* Allocate kernel memory to hold temp data: previous partial writes
-     * (temp_buffer_size) plus this new write (count). We can't write directly to
+    /* Make sure the temp buffer has room for previous partial writes
+     * (temp->size) plus this new write (count). We can't write directly to
      * the circular buffer until we have a complete newline-terminated command.
-     * GFP_KERNEL flag means: can sleep (OK since we're not in interrupt context),
-     * and memory is allocated from normal kernel memory zone. */
-    new_buffer = kmalloc(dev->temp_buffer_size + count, GFP_KERNEL);
-    if (!new_buffer) {
-        mutex_unlock(&dev->lock);
-        return -ENOMEM;  /* Out of memory - kernel couldn't allocate */
-    }
-    
-    /* Copy any previously temp partial data from temp_buffer to new_buffer.
-     * This handles cases like: write("hel"), write("lo\n") → accumulates to "hello\n"
-     * memcpy() is kernel version (similar to userspace memcpy). */
-    if (dev->temp_buffer_size > 0) {
-        memcpy(new_buffer, dev->temp_buffer, dev->temp_buffer_size);
+     * The buffer only grows when it is full, and then at least doubles, so
+     * this usually allocates nothing. */
+    if (aesd_temp_buffer_reserve(dev, temp, count, gfp)) {
+        mutex_unlock(&file->write_lock);
+        return nomem;  /* Out of memory - kernel couldn't allocate */
     }
     
-    /* Copy new data from userspace buffer to kernel buffer.
-     * copy_from_user() is required because kernel can't directly access userspace memory.
-     * It also handles cases where userspace memory becomes invalid during copy.
-     * Appends new data after any existing data in new_buffer. */
-    if (copy_from_user(new_buffer + dev->temp_buffer_size, buf, count)) {
-        kfree(new_buffer);  /* Clean up allocated memory before returning error */
-        mutex_unlock(&dev->lock);
+    /* Copy new data from the userspace buffers to kernel buffer in one go.
+     * copy_from_iter_full() uses copy_from_user() for userspace buffers, since the
+     * kernel can't directly access userspace memory. It also handles cases where
+     * userspace memory becomes invalid during copy.
+     * Appends new data after any existing data, like write("hel"), write("lo\n")
+     * accumulating to "hello\n". On failure the partial data so far is kept as is. */
+    old_size = temp->size;
+    data = temp->buffptr;
+    if (!copy_from_iter_full(data + old_size, count, from)) {
+        mutex_unlock(&file->write_lock);
         return -EFAULT;  /* Failed to read from userspace address */
     }
+    temp->size += count;
     
-    /* Free the old temp_buffer since we've copied its contents to new_buffer */
-    if (dev->temp_buffer) {
-        kfree(dev->temp_buffer);
+    /* Earlier data holds no newline, so only the new bytes need searching.
+     * memchr() is the architecture optimized search, much faster than
+     * looking at one byte at a time. Without a newline there is nothing to
+     * store, and the device lock is not needed at all. */
+    scan = old_size;
+    newline = memchr(data + scan, '\n', temp->size - scan);
+    if (!newline) {
+        goto out;
     }
     
-    /* Update device state with the new temp buffer and its size.
-     * At this point, new_buffer contains all temp data (old + new). */
-    dev->temp_buffer = new_buffer;
-    dev->temp_buffer_size += count;
+    /* Acquire the device mutex to store the complete commands */
+    if (nowait) {
+        if (!mutex_trylock(&dev->lock)) {
+            temp->size = old_size;  /* Give the whole write back */
+            retval = -EAGAIN;
+            goto out;
+        }
+    } else {
+        mutex_lock(&dev->lock);
+    }
     
-    /* If we found a newline, we have a complete command ready to store.
-     * Move the temp buffer into the circular buffer. */
-    if (found_newline) {
-        struct aesd_buffer_entry new_entry;
-        const char *old_entry_ptr = NULL;
+    do {
+        size_t end = newline - data + 1;
+        char *command;
         
-        /* Save pointer to old entry if buffer is full, BEFORE adding new entry.
-         * aesd_circular_buffer_add_entry() handles all the circular buffer logic
-         * (advancing in_offs, out_offs, managing full flag), but it does NOT manage
-         * memory! Per the function's contract: "memory lifetime managed by the caller".
-         * When buffer is full, in_offs points to the slot that will be overwritten. */
-        if (dev->circular_buffer.full) {
-            old_entry_ptr = dev->circular_buffer.entry[dev->circular_buffer.in_offs].buffptr;
+        /* A single command filling the whole buffer: hand the buffer itself over */
+        if (start == 0 && end == temp->size) {
+            aesd_add_entry(dev, data, end);
+            temp->buffptr = NULL;
+            temp->capacity = 0;
+            start = end;
+            break;
         }
         
-        /* Prepare new entry with pointer and size. The circular buffer stores these
-         * values but doesn't own the memory - we're responsible for allocation/deallocation. */
-        new_entry.buffptr = dev->temp_buffer;
-        new_entry.size = dev->temp_buffer_size;
-        
-        /* Add to circular buffer */
-        aesd_circular_buffer_add_entry(&dev->circular_buffer, &new_entry);
-        
-        /* Now free the old memory that was overwritten */
-        if (old_entry_ptr) {
-            kfree(old_entry_ptr);
+        command = aesd_entry_alloc(dev, end - start, gfp);
+        if (!command) {
+            /* Keep what was stored, give back the rest of this write. Stored
+             * commands always end in the new data, past the old partial one. */
+            retval = start > 0 ? (ssize_t)(start - old_size) : nomem;
+            temp->size = start > 0 ? 0 : old_size;
+            start = 0;
+            break;
+        }
+        memcpy(command, data + start, end - start);
+        aesd_add_entry(dev, command, end - start);
+        start = scan = end;
+    } while ((newline = memchr(data + scan, '\n', temp->size - scan)) != NULL);
+    
+    mutex_unlock(&dev->lock);
+    
+    /* Move the trailing partial command to the front for the next write */
+    if (start > 0) {
+        temp->size -= start;
+        if (temp->size > 0) {
+            memmove(temp->buffptr, temp->buffptr + start, temp->size);
         }
-        
-        /* Reset temp_buffer state since we've moved it into the circular buffer */
-        dev->temp_buffer = NULL;
-        dev->temp_buffer_size = 0;
     }
     
+out:
     /* Update file position to point to the end of all data in the buffer.
      * Although the write position is determined by the circular buffer's internal
      * logic (always appending), updating f_pos ensures proper cooperation with
      * llseek(). */
     *f_pos = aesd_get_total_size(dev);
     
-    /* Write succeeded - return number of bytes accepted from userspace.
-     * The kernel will use this return value to update userspace's write() return
-     * and advance any internal tracking. We return count (not the total size) to
-     * indicate how many bytes from the user buffer were successfully processed. */
-    retval = count;
-    mutex_unlock(&dev->lock);
+    if (retval > 0) {
+        atomic64_inc(&dev->stats.writes);
+        atomic64_add(retval, &dev->stats.write_bytes);
+    }
+    
+    /* Return the number of bytes accepted from userspace. The kernel will use
+     * this return value to update userspace's write() return. We return count
+     * (not the total size) to indicate how many bytes from the user buffer were
+     * successfully processed. */
+    mutex_unlock(&file->write_lock);
     return retval;
 }
 
@@ -347,47 +933,23 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
  * aesd_get_total_size() - Calculate total size of all data in circular buffer
  * @dev: Pointer to device structure
  *
- * Iterates through all entries in the circular buffer and sums their sizes.
+ * The circular buffer keeps the total up to date as entries are added and
+ * dropped, so this is O(1) no matter how many entries it holds.
  *
- * Caller must hold the device lock to ensure thread-safe access to the
- * circular buffer during iteration.
+ * Safe without the device lock, the value is read under the seqcount.
  *
  * Return: Total number of bytes stored in the circular buffer
  */
 static size_t aesd_get_total_size(struct aesd_dev *dev)
 {
-    size_t total_size = 0;
-    uint8_t index;
-    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
-    
-    /* Check if buffer is empty. When in_offs equals out_offs, the buffer
-     * could be either completely empty or completely full. We use the full
-     * flag to distinguish between these two cases. If not full and indices
-     * are equal, there's no data in the buffer. */
-    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
-        return 0;
-    }
-    
-    /* Start from output index (oldest entry) and iterate through all valid
-     * entries up to in_offs (where next write will go). This traverses the
-     * logical order of the buffer regardless of how it wraps in the array. */
-    index = buffer->out_offs;
-    while (1) {
-        /* Accumulate size of current entry. Each entry stores a complete
-         * write command (terminated by newline) with its associated size. */
-        total_size += buffer->entry[index].size;
-        
-        /* Advance to next entry with wraparound */
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        
-        /* Stop when we reach in_offs. We've now counted all valid entries.
-         * in_offs points to where the next write will be stored, so it's
-         * not included in our count. */
-        if (index == buffer->in_offs) {
-            break;
-        }
-    }
-    
+    size_t total_size;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        total_size = aesd_circular_buffer_total_size(&dev->circular_buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
     return total_size;
 }
 
@@ -422,26 +984,21 @@ static size_t aesd_get_total_size(struct aesd_dev *dev)
  * Write operations are not affected by file position - they always append.
  *
  * Return: New file position (>= 0) on success, negative error code on failure
- *         -ERESTARTSYS if interrupted by signal, -EINVAL for invalid whence or out of range position
+ *         -EINVAL for invalid whence or out of range position
  */
 static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
     loff_t retval;
     size_t total_size;
     
     PDEBUG("llseek offset %lld whence %d", offset, whence);
     
-    /* Acquire mutex lock to ensure thread-safe access to the circular buffer.*/
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;  /* Tell kernel to restart syscall after signal handled */
-    }
-    
     /* Calculate the total size of all data currently stored in the circular buffer.
      * This represents the sum of all entry sizes in logical order (out_offs to in_offs).
      * We pass this to fixed_size_llseek() which uses it as the maximum valid position.
-     * The size is essentially a snapshot - it may change after we release the lock,
-     * but for the duration of this seek operation, it defines the valid range. */
+     * The size is a snapshot taken without the device lock - writers may change it
+     * right after, but for this seek operation, it defines the valid range. */
     total_size = aesd_get_total_size(dev);
     
     /* Use the kernel's fixed_size_llseek() helper function to perform the actual seek.
@@ -455,11 +1012,6 @@ static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
      */
     retval = fixed_size_llseek(filp, offset, whence, total_size);
     
-    /* Release mutex - the seek operation is complete. fixed_size_llseek() has
-     * already updated filp->f_pos if the seek was valid. Any subsequent operations
-     * will use the new position.*/
-    mutex_unlock(&dev->lock);
-    
     /* Return the result from fixed_size_llseek(). On success, this is the new
      * absolute file position (>= 0). On failure, it's a negative error code */
     return retval;
@@ -476,89 +1028,495 @@ static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
  * - Command 0 always refers to the oldest command still in the buffer (at out_offs)
  * - Commands are numbered sequentially in write order
  *
- * Return: 0 if successful
+ * The command is looked up under the seqcount rather than the device lock,
+ * like read() does.
+ *
+ * Return: 0 if successful, -EINVAL if the command or offset does not exist
  */
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
 {
     struct aesd_dev *dev;
     struct aesd_circular_buffer *buffer;
-    uint8_t count;
-    uint8_t current_index;
-    uint8_t index;
-    size_t cumulative_offset = 0;
+    uint32_t count;
+    size_t cumulative_offset;
+    unsigned int seq;
+    long retval;
     
     /* Retrieve device structure from file's private data.
      * This was set during open() and provides access to our device state. */
-    dev = filp->private_data;
-    
-    /* Acquire mutex lock */
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;  /* Interrupted by signal - kernel will retry */
-    }
-    
+    dev = ((struct aesd_file *)filp->private_data)->dev;
     buffer = &dev->circular_buffer;
     
-    /* Check if buffer is empty */
-    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
-        mutex_unlock(&dev->lock);
-        return -EINVAL;  /* Can't seek in empty buffer */
-    }
+    /* Retry the whole lookup if a writer updated the buffer meanwhile */
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        retval = -EINVAL;
+        cumulative_offset = 0;
+        
+        /* The number of valid entries currently in the circular buffer determines
+         * the valid range for write_cmd parameter [0, count-1]. The free-running
+         * indices make this a plain subtraction, even after they wrap. An empty
+         * buffer has count 0, so every write_cmd is rejected. */
+        count = aesd_circular_buffer_count(buffer);
+        
+        /* Validate that write_cmd is within the valid range of available commands,
+         * and write_cmd_offset within the size of the specified command. */
+        if (write_cmd < count &&
+            write_cmd_offset < aesd_circular_buffer_entry_at(buffer, write_cmd)->size) {
+            /* The cumulative byte offset from the start of the buffer to the beginning
+             * of the target command is kept by the circular buffer, add the byte
+             * offset within the target command to it. */
+            cumulative_offset = aesd_circular_buffer_entry_start(buffer, write_cmd) + write_cmd_offset;
+            retval = 0;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
     
-    /* Calculate the number of valid entries currently in the circular buffer.
-     * This determines the valid range for write_cmd parameter [0, count-1].
-     * 
-     * Three cases to consider:
-     * 1. Buffer is full: All slots are occupied, so count = max capacity
-     * 2. in_offs >= out_offs: Buffer hasn't wrapped yet, count = in_offs - out_offs
-     * 3. in_offs < out_offs: Buffer has wrapped around */
-    if (buffer->full) {
-        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else if (buffer->in_offs >= buffer->out_offs) {
-        count = buffer->in_offs - buffer->out_offs;
-    } else {
-        /* Wrapped case: entries from out_offs to end, plus entries from 0 to in_offs */
-        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs + buffer->in_offs;
-    }
-    
-    /* Validate that write_cmd is within the valid range of available commands.
-     * write_cmd is zero-based, so valid range is [0, count-1]. */
-    if (write_cmd >= count) {
-        mutex_unlock(&dev->lock);
-        return -EINVAL;
-    }
-    
-    /* Calculate the actual array index in the circular buffer for the requested
-     * command wrapping with modulo. */
-    current_index = (buffer->out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    
-    /* Validate that write_cmd_offset is within the size of the specified command. */
-    if (write_cmd_offset >= buffer->entry[current_index].size) {
-        mutex_unlock(&dev->lock);
-        return -EINVAL;
-    }
-    
-    /* Calculate the cumulative byte offset from the start of the buffer to the
-     * beginning of the target command iterating from out_offs to current_index. */
-    index = buffer->out_offs;
-    while (index != current_index) {
-        cumulative_offset += buffer->entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (retval) {
+        return retval;
     }
     
-    /* Add the byte offset within the target command */
-    cumulative_offset += write_cmd_offset;
-    
     /* Update the file structure's position field. This affects subsequent read
      * operations on this file descriptor - they'll start reading from this new
      * position. Each open file descriptor maintains its own f_pos, so different
      * processes can seek to different positions independently. */
     filp->f_pos = cumulative_offset;
-    
-    /* Release mutex */
-    mutex_unlock(&dev->lock);
     return 0;
 }
 
+/*
+ * A snapshot mapped by aesd_mmap(), freed when its last mapping goes away
+ */
+struct aesd_snapshot
+{
+    atomic_t maps;                                 /* Mappings of the snapshot, split and forked ones included */
+    struct page **pages;                           /* Pages holding it, charged to the memcg of the mapper */
+    unsigned long nr_pages;                        /* Number of @pages, those allocated before a failure included */
+};
+
+static void aesd_snapshot_free(struct aesd_snapshot *snapshot)
+{
+    unsigned long index;
+
+    for (index = 0; index < snapshot->nr_pages; index++) {
+        __free_page(snapshot->pages[index]);
+    }
+    kvfree(snapshot->pages);
+    kfree(snapshot);
+}
+
+static void aesd_snapshot_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snapshot = vma->vm_private_data;
+
+    atomic_inc(&snapshot->maps);
+}
+
+static void aesd_snapshot_vma_close(struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snapshot = vma->vm_private_data;
+
+    if (atomic_dec_and_test(&snapshot->maps)) {
+        aesd_snapshot_free(snapshot);
+    }
+}
+
+static const struct vm_operations_struct aesd_snapshot_vm_ops = {
+    .open = aesd_snapshot_vma_open,
+    .close = aesd_snapshot_vma_close,
+};
+
+/*
+ * Length of a snapshot holding @count commands of @total_size bytes in all
+ */
+static size_t aesd_snapshot_size(uint32_t count, size_t total_size)
+{
+    return PAGE_ALIGN(sizeof(struct aesd_mmap_snapshot) +
+                      (size_t)count * sizeof(struct aesd_mmap_entry) + total_size);
+}
+
+/*
+ * Length of a snapshot of the commands stored right now
+ */
+static size_t aesd_snapshot_map_size(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    size_t total_size;
+    uint32_t count;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        count = min(aesd_circular_buffer_count(buffer), buffer->capacity);
+        total_size = aesd_circular_buffer_total_size(buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return aesd_snapshot_size(count, total_size);
+}
+
+/**
+ * aesd_snapshot_fill() - Copy the stored commands into a snapshot
+ * @dev: Pointer to device structure
+ * @buf: Zeroed memory for the snapshot, see struct aesd_mmap_snapshot
+ * @size: Size of @buf
+ *
+ * Like read(), this runs without the device lock. The entries are copied out
+ * of the circular buffer under the seqcount, then their data in an SRCU read
+ * section that keeps it from being freed, so the snapshot shows the commands
+ * stored at one moment and a large one does not hold up writers.
+ *
+ * Return: 0 on success, -ENOMEM if out of memory
+ */
+static int aesd_snapshot_fill(struct aesd_dev *dev, void *buf, size_t size)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    struct aesd_mmap_snapshot *header = buf;
+    struct aesd_mmap_entry *table = (struct aesd_mmap_entry *)(header + 1);
+    struct aesd_buffer_entry *entries;
+    size_t needed = sizeof(*header);
+    size_t data_size = 0;
+    uint64_t generation;
+    size_t base_offset;
+    size_t total_size;
+    uint32_t count;
+    uint32_t fit;
+    uint32_t index;
+    unsigned int seq;
+    int srcu_idx;
+    char *data;
+
+    entries = kvmalloc_array(buffer->capacity, sizeof(*entries), GFP_KERNEL);
+    if (!entries) {
+        return -ENOMEM;
+    }
+
+    srcu_idx = srcu_read_lock(&dev->srcu);
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        count = min(aesd_circular_buffer_count(buffer), buffer->capacity);
+        for (index = 0; index < count; index++) {
+            entries[index] = *aesd_circular_buffer_entry_at(buffer, index);
+        }
+        generation = READ_ONCE(dev->status->generation);
+        base_offset = aesd_circular_buffer_base_offset(buffer);
+        total_size = aesd_circular_buffer_total_size(buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    /* Take the oldest commands that fit along with their table entries */
+    for (fit = 0; fit < count; fit++) {
+        needed = sizeof(*header) + (fit + 1) * sizeof(*table) + data_size + entries[fit].size;
+        if (needed > size) {
+            break;
+        }
+        data_size += entries[fit].size;
+    }
+
+    header->magic = AESDCHAR_MMAP_MAGIC;
+    header->entry_count = fit;
+    header->total_entries = count;
+    header->generation = generation;
+    header->base_offset = base_offset;
+    header->data_offset = sizeof(*header) + fit * sizeof(*table);
+    header->data_size = data_size;
+    header->map_size = aesd_snapshot_size(count, total_size);
+
+    data = (char *)buf + header->data_offset;
+    for (index = 0; index < fit; index++) {
+        table[index].offset = entries[index].offset - base_offset;
+        table[index].size = entries[index].size;
+        memcpy(data + table[index].offset, entries[index].buffptr, entries[index].size);
+    }
+
+    srcu_read_unlock(&dev->srcu, srcu_idx);
+    kvfree(entries);
+    return 0;
+}
+
+/**
+ * aesd_mmap_snapshot() - Map a new snapshot of the stored commands
+ * @dev: Pointer to device structure
+ * @vma: The user space region being mapped, sized by the caller
+ *
+ * Only as much memory as the snapshot needs is allocated, however long the
+ * mapping, and it is charged to the caller's memory cgroup. The part of the
+ * mapping past it is left without pages, accessing it raises SIGBUS.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int aesd_mmap_snapshot(struct aesd_dev *dev, struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snapshot;
+    unsigned long nr_pages;
+    size_t size;
+    void *buf;
+    int ret;
+
+    /* Commands stored after this are left out by aesd_snapshot_fill() if
+     * they do not fit, as with a short mapping */
+    size = min_t(size_t, vma->vm_end - vma->vm_start, aesd_snapshot_map_size(dev));
+    nr_pages = size >> PAGE_SHIFT;
+
+    snapshot = kzalloc(sizeof(*snapshot), GFP_KERNEL);
+    if (!snapshot) {
+        return -ENOMEM;
+    }
+
+    snapshot->pages = kvcalloc(nr_pages, sizeof(*snapshot->pages), GFP_KERNEL_ACCOUNT);
+    if (!snapshot->pages) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+    for (; snapshot->nr_pages < nr_pages; snapshot->nr_pages++) {
+        snapshot->pages[snapshot->nr_pages] = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (!snapshot->pages[snapshot->nr_pages]) {
+            ret = -ENOMEM;
+            goto err_free;
+        }
+    }
+
+    /* The pages are only mapped in the kernel while the snapshot is taken */
+    buf = vmap(snapshot->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+    ret = aesd_snapshot_fill(dev, buf, size);
+    vunmap(buf);
+    if (ret) {
+        goto err_free;
+    }
+
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    ret = vm_insert_pages(vma, vma->vm_start, snapshot->pages, &nr_pages);
+    if (ret) {
+        goto err_free;
+    }
+
+    atomic_set(&snapshot->maps, 1);
+    vma->vm_private_data = snapshot;
+    vma->vm_ops = &aesd_snapshot_vm_ops;
+    return 0;
+
+err_free:
+    aesd_snapshot_free(snapshot);
+    return ret;
+}
+
+/**
+ * aesd_mmap() - Map the status page or a snapshot of the commands read only
+ * @filp: File pointer for the open device instance
+ * @vma: The user space region being mapped
+ *
+ * The offset selects what is mapped, see AESDCHAR_MMAP_STATUS_PGOFF and
+ * AESDCHAR_MMAP_SNAPSHOT_PGOFF. Nothing can be written through either mapping,
+ * mprotect() included, so MAP_SHARED and MAP_PRIVATE behave the same.
+ *
+ * Return: 0 on success, -EACCES for a writable mapping, -EINVAL for an
+ *         unknown offset or a status mapping longer than a page, -ENOMEM
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EACCES;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+
+    switch (vma->vm_pgoff) {
+        case AESDCHAR_MMAP_STATUS_PGOFF:
+            if (vma->vm_end - vma->vm_start > PAGE_SIZE) {
+                return -EINVAL;
+            }
+            return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->status));
+
+        case AESDCHAR_MMAP_SNAPSHOT_PGOFF:
+            return aesd_mmap_snapshot(dev, vma);
+
+        default:
+            return -EINVAL;
+    }
+}
+
+/**
+ * aesd_set_follow() - Turn follow mode of an open file on or off
+ * @filp: File pointer for the open device instance
+ * @follow: Whether read() at the end of the data should wait for more
+ *
+ * Follow mode starts at the current file position.
+ *
+ * Return: 0
+ */
+static long aesd_set_follow(struct file *filp, bool follow)
+{
+    struct aesd_file *file = filp->private_data;
+    size_t base;
+    size_t end;
+
+    if (follow && !file->follow) {
+        end = aesd_stream_range(file->dev, &base);
+        file->follow_pos = aesd_file_stream_pos(file, filp->f_pos, base, end);
+        file->follow_fpos = filp->f_pos;
+    }
+    file->follow = follow;
+    return 0;
+}
+
+/**
+ * aesd_poll() - Report whether read() or write() would block
+ * @filp: File pointer for the open device instance
+ * @wait: Poll table to register our wait queue with
+ *
+ * The device is readable when there is data at the file position, or at the
+ * stream position of a follow mode file, and woken up for every command stored,
+ * so poll()/epoll() users sleep until a write brings them something to read.
+ * Writes only ever wait for other writers, so the device is always writable.
+ *
+ * Return: Mask of EPOLL* events ready now
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    size_t base;
+    size_t end;
+
+    poll_wait(filp, &file->dev->wait, wait);
+
+    end = aesd_stream_range(file->dev, &base);
+    if (aesd_file_stream_pos(file, filp->f_pos, base, end) != end) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+/**
+ * aesd_get_entries() - Copy consecutive commands and their metadata to user space
+ * @dev: Pointer to device structure
+ * @write_cmd: Zero-based index of the first command
+ * @write_cmd_offset: Offset within the first command to start copying at
+ * @buf: User space buffer the command data is copied to, back to back
+ * @buf_len: Size of @buf
+ * @entries: Room for @count entries of the circular buffer
+ * @info: Filled with the metadata of the commands
+ * @count: Number of commands wanted
+ * @copied: Set to the number of bytes copied to @buf
+ *
+ * The commands are taken under the seqcount in one go, so they are consecutive
+ * even if writers drop older ones meanwhile, and their data copied out in an SRCU
+ * read section like read() does. Sequence numbers follow from the generation,
+ * which counts every command stored.
+ *
+ * Return: Number of commands described in @info, -EINVAL if @write_cmd is not
+ *         stored or @write_cmd_offset beyond its size, -EFAULT on a bad @buf
+ */
+static long aesd_get_entries(struct aesd_dev *dev, uint32_t write_cmd, uint32_t write_cmd_offset,
+                char __user *buf, size_t buf_len, struct aesd_buffer_entry *entries,
+                struct aesd_entry_info *info, uint32_t count, uint64_t *copied)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    uint64_t generation;
+    size_t base_offset;
+    size_t skip = write_cmd_offset;
+    size_t pos = 0;
+    size_t len;
+    uint32_t stored;
+    uint32_t found;
+    uint32_t index;
+    unsigned int seq;
+    int srcu_idx;
+    long retval;
+
+    srcu_idx = srcu_read_lock(&dev->srcu);
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        stored = min(aesd_circular_buffer_count(buffer), buffer->capacity);
+        found = write_cmd < stored ? min(count, stored - write_cmd) : 0;
+        for (index = 0; index < found; index++) {
+            entries[index] = *aesd_circular_buffer_entry_at(buffer, write_cmd + index);
+        }
+        generation = READ_ONCE(dev->status->generation);
+        base_offset = aesd_circular_buffer_base_offset(buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (found == 0 || write_cmd_offset >= entries[0].size) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    for (index = 0; index < found; index++) {
+        info[index].sequence = generation - stored + write_cmd + index;
+        info[index].offset = entries[index].offset - base_offset;
+        info[index].size = entries[index].size;
+
+        len = min(entries[index].size - skip, buf_len - pos);
+        if (len > 0 && copy_to_user(buf + pos, entries[index].buffptr + skip, len)) {
+            retval = -EFAULT;
+            goto out;
+        }
+        pos += len;
+        skip = 0;
+    }
+
+    *copied = pos;
+    retval = found;
+
+out:
+    srcu_read_unlock(&dev->srcu, srcu_idx);
+    return retval;
+}
+
+/**
+ * aesd_get_range() - Handle AESDCHAR_IOCGETRANGE
+ * @dev: Pointer to device structure
+ * @urange: User space struct aesd_getrange
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static long aesd_get_range(struct aesd_dev *dev, struct aesd_getrange __user *urange)
+{
+    struct aesd_getrange range;
+    struct aesd_buffer_entry *entries;
+    struct aesd_entry_info *info;
+    uint32_t count;
+    long retval;
+
+    if (copy_from_user(&range, urange, sizeof(range)) != 0) {
+        return -EFAULT;
+    }
+    if (range.count == 0) {
+        return -EINVAL;
+    }
+
+    /* No more than the device can hold are ever returned */
+    count = min(range.count, dev->circular_buffer.capacity);
+    entries = kvmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+    info = kvmalloc_array(count, sizeof(*info), GFP_KERNEL);
+    if (!entries || !info) {
+        retval = -ENOMEM;
+        goto out;
+    }
+
+    retval = aesd_get_entries(dev, range.write_cmd, range.write_cmd_offset,
+                u64_to_user_ptr(range.buf), range.buf_len, entries, info, count, &range.copied);
+    if (retval < 0) {
+        goto out;
+    }
+    range.count = retval;
+    retval = 0;
+
+    if (copy_to_user(u64_to_user_ptr(range.info), info, range.count * sizeof(*info)) != 0 ||
+        copy_to_user(urange, &range, sizeof(range)) != 0) {
+        retval = -EFAULT;
+    }
+
+out:
+    kvfree(info);
+    kvfree(entries);
+    return retval;
+}
+
 /**
  * aesd_ioctl() - Handle ioctl commands for the device
  * @filp: File pointer for the open device instance
@@ -567,6 +1525,10 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
  * 
  * Currently supports:
  * - AESDCHAR_IOCSEEKTO: Seek to a specific write command and byte offset within it
+ * - AESDCHAR_IOCFOLLOW: Turn follow mode on or off, see aesd_read_iter()
+ * - AESDCHAR_IOCGETENTRY: Read one command and its metadata, like AESDCHAR_IOCSEEKTO
+ *   followed by read() but in one call and without moving the file position
+ * - AESDCHAR_IOCGETRANGE: The same for consecutive commands, see aesd_get_range()
  *
  * The AESDCHAR_IOCSEEKTO command takes a struct aesd_seekto from user space:
  *
@@ -575,11 +1537,16 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
  *       uint32_t write_cmd_offset; // Zero-based byte offset within that command
  *   };
  *
- * Return: New file position (>= 0) on success, negative error code on failure
+ * Return: New file position (>= 0) for AESDCHAR_IOCSEEKTO, 0 for the others,
+ *         negative error code on failure
  */
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_buffer_entry entry;
     struct aesd_seekto seekto;
+    struct aesd_getentry getentry;
+    uint32_t follow;
     long retval;
     
     PDEBUG("ioctl cmd %u", cmd);
@@ -609,7 +1576,7 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             
             /* Use the helper function to adjust the file offset based on the
              * command and offset specified in the seekto structure. This helper
-             * handles all the validation, calculation, and mutex locking. */
+             * handles all the validation and calculation. */
             retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
             
             if (retval != 0) {
@@ -621,6 +1588,30 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
              * which was set by aesd_adjust_file_offset(). */
             return filp->f_pos;
             
+        case AESDCHAR_IOCFOLLOW:
+            if (get_user(follow, (const uint32_t __user *)arg)) {
+                return -EFAULT;  /* Bad userspace address */
+            }
+            return aesd_set_follow(filp, follow != 0);
+            
+        case AESDCHAR_IOCGETENTRY:
+            if (copy_from_user(&getentry, (const void __user *)arg, sizeof(getentry)) != 0) {
+                return -EFAULT;  /* Bad userspace address */
+            }
+            retval = aesd_get_entries(dev, getentry.write_cmd, getentry.write_cmd_offset,
+                        u64_to_user_ptr(getentry.buf), getentry.buf_len,
+                        &entry, &getentry.info, 1, &getentry.copied);
+            if (retval < 0) {
+                return retval;
+            }
+            if (copy_to_user((void __user *)arg, &getentry, sizeof(getentry)) != 0) {
+                return -EFAULT;
+            }
+            return 0;
+            
+        case AESDCHAR_IOCGETRANGE:
+            return aesd_get_range(dev, (struct aesd_getrange __user *)arg);
+            
         default:
             /* Unrecognized ioctl command number */
             return -ENOTTY;
@@ -629,17 +1620,119 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .splice_read = copy_splice_read,
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
+    .poll =     aesd_poll,
+    .mmap =     aesd_mmap,
     .unlocked_ioctl = aesd_ioctl
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/* ---------- sysfs statistics ---------- */
+
+/*
+ * /sys/class/aesdchar_class/aesdcharN/stats/ holds the write and command memory
+ * counters of the device along with its current contents. Writing anything to
+ * stats/reset zeroes the counters.
+ */
+#define AESD_STAT_ATTR(_name)                                                  \
+static ssize_t _name##_show(struct device *device, struct device_attribute *attr, \
+                            char *buf)                                         \
+{                                                                              \
+    struct aesd_dev *dev = dev_get_drvdata(device);                            \
+                                                                               \
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&dev->stats._name));        \
+}                                                                              \
+static DEVICE_ATTR_RO(_name)
+
+AESD_STAT_ATTR(writes);
+AESD_STAT_ATTR(write_bytes);
+AESD_STAT_ATTR(commands);
+AESD_STAT_ATTR(dropped);
+AESD_STAT_ATTR(dropped_bytes);
+AESD_STAT_ATTR(alloc_slab);
+AESD_STAT_ATTR(alloc_large);
+AESD_STAT_ATTR(alloc_reused);
+AESD_STAT_ATTR(recycled);
+AESD_STAT_ATTR(frees);
+
+static ssize_t entries_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%u\n", aesd_circular_buffer_count(&dev->circular_buffer));
+}
+static DEVICE_ATTR_RO(entries);
+
+static ssize_t bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%zu\n", aesd_get_total_size(dev));
+}
+static DEVICE_ATTR_RO(bytes);
+
+static ssize_t capacity_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%u\n", dev->circular_buffer.capacity);
+}
+static DEVICE_ATTR_RO(capacity);
+
+static ssize_t reset_store(struct device *device, struct device_attribute *attr,
+                           const char *buf, size_t count)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    atomic64_set(&dev->stats.writes, 0);
+    atomic64_set(&dev->stats.write_bytes, 0);
+    atomic64_set(&dev->stats.commands, 0);
+    atomic64_set(&dev->stats.dropped, 0);
+    atomic64_set(&dev->stats.dropped_bytes, 0);
+    atomic64_set(&dev->stats.alloc_slab, 0);
+    atomic64_set(&dev->stats.alloc_large, 0);
+    atomic64_set(&dev->stats.alloc_reused, 0);
+    atomic64_set(&dev->stats.recycled, 0);
+    atomic64_set(&dev->stats.frees, 0);
+    return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *aesd_stats_attrs[] = {
+    &dev_attr_writes.attr,
+    &dev_attr_write_bytes.attr,
+    &dev_attr_commands.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_dropped_bytes.attr,
+    &dev_attr_alloc_slab.attr,
+    &dev_attr_alloc_large.attr,
+    &dev_attr_alloc_reused.attr,
+    &dev_attr_recycled.attr,
+    &dev_attr_frees.attr,
+    &dev_attr_entries.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_capacity.attr,
+    &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group aesd_stats_group = {
+    .name = "stats",
+    .attrs = aesd_stats_attrs,
+};
+
+static const struct attribute_group *aesd_groups[] = {
+    &aesd_stats_group,
+    NULL,
+};
+
+static int aesd_setup_cdev(struct aesd_dev *dev, dev_t devno)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err;
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -651,21 +1744,112 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     return err;
 }
 
+/**
+ * aesd_dev_init() - Initialize the members of one device structure
+ * @dev: Zeroed device structure
+ *
+ * The circular buffer allocates its ring here when the capacity needs more
+ * than the built-in one, and the status page mapped by aesd_mmap() is allocated.
+ *
+ * Return: 0 on success, negative error code on failure with nothing left allocated
+ */
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    unsigned int size_class;
+    int result;
+
+    result = aesd_circular_buffer_init_capacity(&dev->circular_buffer, capacity);
+    if (result) {
+        printk(KERN_WARNING "Can't keep %u write commands\n", capacity);
+        return result;
+    }
+    result = init_srcu_struct(&dev->srcu);
+    if (result) {
+        aesd_circular_buffer_destroy(&dev->circular_buffer);
+        return result;
+    }
+    /* The status page is mapped by aesd_mmap(), so it gets a whole page */
+    dev->status = (struct aesd_mmap_status *)get_zeroed_page(GFP_KERNEL);
+    if (!dev->status) {
+        cleanup_srcu_struct(&dev->srcu);
+        aesd_circular_buffer_destroy(&dev->circular_buffer);
+        return -ENOMEM;
+    }
+    dev->status->magic = AESDCHAR_MMAP_MAGIC;
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->wait);
+    dev->leftover.buffptr = NULL;
+    dev->leftover.size = 0;
+    dev->leftover.capacity = 0;
+    for (size_class = 0; size_class < AESD_SIZE_CLASSES; size_class++) {
+        spin_lock_init(&dev->free_lists[size_class].lock);
+    }
+    return 0;
+}
+
+/**
+ * aesd_dev_cleanup() - Free everything aesd_dev_init() and the writers allocated
+ * @dev: Device structure whose character device is gone
+ */
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    /* Free all dynamically allocated memory, after the entries dropped
+     * by writers whose free was deferred to the end of a grace period */
+    srcu_barrier(&dev->srcu);
+    cleanup_srcu_struct(&dev->srcu);
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) {
+        aesd_entry_free(entry->buffptr);
+    }
+    aesd_circular_buffer_destroy(&dev->circular_buffer);
+    
+    aesd_entry_free(dev->leftover.buffptr);
+    aesd_free_lists_drain(dev);
+    free_page((unsigned long)dev->status);
+    
+    mutex_destroy(&dev->lock);
+}
+
+/**
+ * aesd_remove_devices() - Remove the first @count devices, newest first
+ * @count: Number of devices aesd_init_module() set up completely
+ */
+static void aesd_remove_devices(unsigned int count)
+{
+    dev_t devno;
 
+    while (count-- > 0) {
+        devno = MKDEV(aesd_major, aesd_minor + count);
+        device_destroy(aesd_class, devno);
+        cdev_del(&aesd_devices[count].cdev);
+        aesd_dev_cleanup(&aesd_devices[count]);
+    }
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    dev_t devno;
+    struct device *device;
+    unsigned int i;
     int result;
 
+    if (nr_devs < 1 || nr_devs > AESD_MAX_DEVS) {
+        printk(KERN_WARNING "nr_devs must be 1 to %d\n", AESD_MAX_DEVS);
+        return -EINVAL;
+    }
+
     /* 1. Allocate a range of device numbers
      * int alloc_chrdev_region(dev_t * dev, unsigned baseminor, unsigned count, const char * name);
      * @param dev: Pointer to dev_t variable to store the first allocated device number
      * @param baseminor: First minor number to allocate (0 in our case)
-     * @param count: Number of contiguous minor numbers to allocate (1 in our case)
+     * @param count: Number of contiguous minor numbers to allocate (nr_devs in our case)
      * @param name: Name of the device as it will appear in /proc/devices      * 
      */
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    result = alloc_chrdev_region(&dev, aesd_minor, nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
@@ -673,59 +1857,87 @@ int aesd_init_module(void)
         return result;
     }
     
-    /* 2. Initialize the members in the device structure */
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
-    aesd_device.temp_buffer = NULL;
-    aesd_device.temp_buffer_size = 0;
+    /* 2. Create the slab caches command memory of all devices comes from, then
+     * allocate the device structures, each with its own buffer and lock, and the
+     * class their nodes and statistics show up in under /sys/class/aesdchar_class/ */
+    result = aesd_entry_caches_create();
+    if (result) {
+        goto err_region;
+    }
+    aesd_devices = kcalloc(nr_devs, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto err_caches;
+    }
+    aesd_class = class_create(AESD_CLASS_NAME);
+    if (IS_ERR(aesd_class)) {
+        result = PTR_ERR(aesd_class);
+        goto err_devices;
+    }
+
+    for (i = 0; i < nr_devs; i++) {
+        devno = MKDEV(aesd_major, aesd_minor + i);
+        
+        /* 3. Initialize the members in the device structure */
+        result = aesd_dev_init(&aesd_devices[i]);
+        if (result) {
+            goto err_remove;
+        }
 
-    /* 3. Register the character device. 
-     * aesd_setup_cdev() initializes and adds our cdev structure to the kernel,
-     * connecting our device number (major, minor) to our file_operations (aesd_fops).
-     * After this succeeds, the kernel knows to call our read/write/open/release
-     * functions when userspace interacts with /dev/aesdchar. */
-    result = aesd_setup_cdev(&aesd_device);
+        /* 4. Register the character device. 
+         * aesd_setup_cdev() initializes and adds our cdev structure to the kernel,
+         * connecting our device number (major, minor) to our file_operations (aesd_fops).
+         * After this succeeds, the kernel knows to call our read/write/open/release
+         * functions when userspace interacts with /dev/aesdcharN. */
+        result = aesd_setup_cdev(&aesd_devices[i], devno);
+        if (result) {
+            aesd_dev_cleanup(&aesd_devices[i]);
+            goto err_remove;
+        }
 
-    /* 4. If aesd_setup_cdev failed, clean up everything we allocated */
-    if( result ) {
-        mutex_destroy(&aesd_device.lock);
-        unregister_chrdev_region(dev, 1);
+        /* 5. Announce it with its statistics, the load script creates the node from it */
+        device = device_create_with_groups(aesd_class, NULL, devno, &aesd_devices[i],
+                                           aesd_groups, "aesdchar%u", i);
+        if (IS_ERR(device)) {
+            result = PTR_ERR(device);
+            cdev_del(&aesd_devices[i].cdev);
+            aesd_dev_cleanup(&aesd_devices[i]);
+            goto err_remove;
+        }
     }
 
+    return 0;
+
+    /* If anything failed, clean up everything we set up, in reverse order */
+err_remove:
+    aesd_remove_devices(i);
+    class_destroy(aesd_class);
+err_devices:
+    kfree(aesd_devices);
+err_caches:
+    aesd_entry_caches_destroy();
+err_region:
+    unregister_chrdev_region(dev, nr_devs);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
 
     /* Cleanup should happen in reverse order of initialization */
 
-    /* 1. Remove the character device from the kernel */
-    cdev_del(&aesd_device.cdev);
-
-    /* 2. Free all dynamically allocated memory */
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, index) {
-        if (entry->buffptr != NULL) {
-            kfree(entry->buffptr);
-        }
-    }
-    
-    if (aesd_device.temp_buffer) {
-        kfree(aesd_device.temp_buffer);
-    }
-    
-    /* 3. Destroy mutex */
-    mutex_destroy(&aesd_device.lock);
+    /* 1. Remove the character devices from the kernel and free their memory */
+    aesd_remove_devices(nr_devs);
+    class_destroy(aesd_class);
+    kfree(aesd_devices);
+    aesd_entry_caches_destroy();
     
-    /* 4. Unregister device numbers:
+    /* 2. Unregister device numbers:
      *    - This releases the major/minor number(s) back to the kernel
      *    - Must be done last, after cdev_del(), to ensure no operations are in flight
-     *    - The count (1) must match what was allocated in alloc_chrdev_region() */
-    unregister_chrdev_region(devno, 1);
+     *    - The count (nr_devs) must match what was allocated in alloc_chrdev_region() */
+    unregister_chrdev_region(devno, nr_devs);
 }
 
 
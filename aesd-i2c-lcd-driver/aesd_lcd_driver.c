@@ -6,288 +6,995 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/property.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
 #include "aesd_lcd_ioctl.h"
+#include "aesd_lcd_hd44780.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesd_lcd_trace.h"
 
 #define DRIVER_NAME "aesdlcd_driver"
 #define LCD_CLASS_NAME "aesdlcd_class"
 
+/* Displays handled at once, each gets the minor of its /dev/aesdlcdN node */
+#define LCD_MAX_DEVICES 8
+
 /*
- * HD44780 LCD CONTROL VIA I2C
- * =========================================================================
+ * The HD44780/PCF8574 byte stream itself is generated by aesd_lcd_hd44780.c,
+ * which documents the protocol. This file wires it to the I2C core and
+ * implements the character device on top of it.
+ */
+
+
+/* Define the maximum IOCTL command number for validation checks.
+ * Currently 14 commands are defined in aesdlcd_ioctl.h */
+#define LCD_IOC_MAXNR 14
+
+
+/* Text writes and ioctls are queued rather than executed by the caller.
+ * LCD_OP_WRITE marks text, every other command is stored as its ioctl number
+ * (which always has LCD_IOC_MAGIC in it, so can never be 0). */
+#define LCD_OP_WRITE 0
+
+/* Text waiting for the display is staged in a ring of this many bytes (a
+ * power of two), allocated at probe. Draining a full ring takes about two
+ * seconds at 100kHz, which bounds how far the display can lag behind. */
+#define LCD_TEXT_RING_SIZE 4096
+
+/* Commands that can wait in the queue, also allocated at probe */
+#define LCD_QUEUE_CMDS 64
+
+/* Command statistics are kept per ioctl number, with text writes at 0 */
+#define LCD_CMD_TYPES (LCD_IOC_MAXNR + 1)
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Scott Karl");
+MODULE_DESCRIPTION("AESD I2C LCD Driver for Raspberry Pi");
+
+/* Interval at which the mmap() framebuffer is compared against the display
+ * and changed cells are pushed out. 0 disables the periodic refresh so that
+ * only LCD_FB_FLUSH and msync()/fsync() update the display. Registered
+ * further down, along with the refresh work it restarts when changed. */
+static unsigned int fb_refresh_ms = 100;
+
+/* Poll the busy flag instead of waiting out worst case execution times.
+ * Requires the RW line to be wired to the PCF8574; probe checks this and
+ * falls back to fixed delays when the flag cannot be read back. */
+static bool busy_poll;
+module_param(busy_poll, bool, S_IRUGO);
+MODULE_PARM_DESC(busy_poll, "Poll the HD44780 busy flag instead of using fixed delays");
+
+/* Size of the character grid. 0 takes the size from the device tree
+ * (display-height-chars / display-width-chars), or the 16x2 default. */
+static unsigned int rows;
+module_param(rows, uint, S_IRUGO);
+MODULE_PARM_DESC(rows, "Number of character rows (0 = device tree or 2)");
+
+static unsigned int cols;
+module_param(cols, uint, S_IRUGO);
+MODULE_PARM_DESC(cols, "Number of character columns (0 = device tree or 16)");
+
+/* Shared by all displays: one class, one major with LCD_MAX_DEVICES minors.
+ * lcd_minors maps each minor in use to its display, open() looks it up there
+ * under lcd_minors_lock. */
+static struct class *lcd_class;
+static dev_t lcd_devt;
+static DEFINE_IDR(lcd_minors);
+static DEFINE_MUTEX(lcd_minors_lock);
+
+/**
+ * struct lcd_stats - Counters exported under the device's sysfs node
+ * @i2c_writes: Bytes written to the PCF8574, one SMBus transaction each
+ * @i2c_reads: Reads of the PCF8574 pins, for the busy flag
+ * @i2c_errors: Transactions the adapter reported as failed
+ * @i2c_ns: Time spent in those transactions
+ * @delay_ns: Time spent in the delays the controller needs between them
+ * @text_bytes: Text bytes accepted by write()
+ * @cmds: Commands submitted, indexed by _IOC_NR() of the ioctl, write() calls at 0
+ * @merged: Commands folded into one that was already queued
+ * @cleared: Queued commands dropped because a clear followed them
+ * @queue_depth_max: Most commands waiting at once, lcd_dev.queued_cmds is the current depth
  *
- * 1. I2C "BACKPACK" DATA BYTE MAPPING
- * -------------------------------------------------------------------------
- * The PCF8574 IO expander connects the 8-bit I2C byte to the LCD pins.
- * In 4-bit mode, only the upper nibble (D4-D7) is used for data.
+ * Bus and command counters are atomic so they can be read without the locks.
+ * @queue_depth_max is updated under lcd_dev.queue_lock.
+ */
+struct lcd_stats {
+    atomic64_t i2c_writes;
+    atomic64_t i2c_reads;
+    atomic64_t i2c_errors;
+    atomic64_t i2c_ns;
+    atomic64_t delay_ns;
+    atomic64_t text_bytes;
+    atomic64_t cmds[LCD_CMD_TYPES];
+    atomic64_t merged;
+    atomic64_t cleared;
+    unsigned int queue_depth_max;
+};
+
+/**
+ * struct lcd_cmd - One queued display operation
+ * @list: Link in lcd_dev.queue, or in lcd_dev.cmd_free while unused
+ * @seq: Sequence number of the last submission merged into this command
+ * @op: LCD_OP_WRITE or the ioctl command number
+ * @arg: ioctl argument, for LCD_MARQUEE the copied struct lcd_marquee
+ * @len: For LCD_OP_WRITE, bytes of text at the consumer's end of lcd_dev.text
+ */
+struct lcd_cmd {
+    struct list_head list;
+    u64 seq;
+    unsigned int op;
+    unsigned long arg;
+    size_t len;
+};
+
+/**
+ * struct lcd_dev - Internal device structure
+ * @client: Pointer to the I2C client struct provided by the kernel
+ * @ref: Held by the bound I2C device, every open file and every mapping of @fb;
+ *       the structure, @fb and @text are freed when the last one goes
+ * @removed: Set once the display is unbound, protected by both @lock and
+ *           @queue_lock. From then on nothing touches the bus or the workqueue
+ *           and file operations fail with -ENODEV.
+ * @cdev: Character device for kernel registration, allocated on its own since
+ *        the VFS can still hold it after the last reference to the display
+ * @dev_num: The major/minor device number, the minor is N in /dev/aesdlcdN
+ * @wq: Runs this display's queue, refresh and marquee work, so a slow
+ *      display never holds up the work of another one
+ * @hd: HD44780 controller state (backlight, display control, entry mode,
+ *      geometry, address counter and shadow of the visible cells)
+ * @lock: Serializes bus access between the queue, the refresh work and the marquee
+ * @fb: Page shared with user space through mmap(), a rows x cols grid
+ * @fb_maps: Number of live user space mappings of @fb
+ * @refresh_work: Periodic work pushing @fb changes out to the display
+ * @marquee_timer: Fires once per marquee step and queues @marquee_work
+ * @marquee_work: Redraws the marquee row, the I2C transfers need process context
+ * @marquee_steps: Timer periods elapsed since @marquee_work last ran
+ * @marquee_interval: Time per marquee step
+ * @marquee_row: Row the marquee scrolls in
+ * @marquee_pos: Position in the message shown in the first column
+ * @marquee_len: Length of @marquee_text, 0 when no marquee is running
+ * @marquee_text: The scrolling message
+ * @queue: Commands waiting for @queue_work, in submission order
+ * @queue_lock: Protects @queue, @cmd_free, the text ring indices and the
+ *              counters below
+ * @queue_work: The single consumer executing @queue
+ * @queue_wait: Woken when commands complete, for writers waiting for room
+ *              and for callers waiting for the queue to drain
+ * @submit_lock: Serializes submitters, held while text is copied into @text
+ * @cmd_pool: All commands of this display, allocated once with the device
+ * @cmd_free: Commands of @cmd_pool not in @queue
+ * @text: Ring of LCD_TEXT_RING_SIZE bytes holding the text of queued writes
+ * @text_head: Free-running index where the next text goes, moved by submitters
+ * @text_tail: Free-running index of the oldest unsent text, moved by the consumer
+ * @queued_cmds: Number of commands in @queue
+ * @queued_seq: Sequence number of the last submitted command
+ * @done_seq: Sequence number of the last completed command
+ * @stats: Counters for sysfs
  *
- * Bit 7 | Bit 6 | Bit 5 | Bit 4 | Bit 3 | Bit 2 | Bit 1 | Bit 0
- * ------+-------+-------+-------+-------+-------+-------+------
- *   D7  |   D6  |   D5  |   D4  |   BL  |   EN  |   RW  |   RS
+ * The marquee fields other than @marquee_steps are protected by @lock.
+ */
+struct lcd_dev {
+    struct i2c_client *client;
+    struct kref ref;
+    bool removed;
+    struct cdev *cdev;
+    dev_t dev_num;
+    struct workqueue_struct *wq;
+    struct lcd_hd44780 hd;
+    struct mutex lock;
+    char *fb;
+    atomic_t fb_maps;
+    struct delayed_work refresh_work;
+    struct hrtimer marquee_timer;
+    struct work_struct marquee_work;
+    atomic_t marquee_steps;
+    ktime_t marquee_interval;
+    unsigned int marquee_row;
+    size_t marquee_pos;
+    size_t marquee_len;
+    char marquee_text[LCD_MARQUEE_MAX_LEN];
+    struct list_head queue;
+    spinlock_t queue_lock;
+    struct work_struct queue_work;
+    wait_queue_head_t queue_wait;
+    struct mutex submit_lock;
+    struct lcd_cmd cmd_pool[LCD_QUEUE_CMDS];
+    struct list_head cmd_free;
+    char *text;
+    unsigned int text_head;
+    unsigned int text_tail;
+    unsigned int queued_cmds;
+    u64 queued_seq;
+    u64 done_seq;
+    struct lcd_stats stats;
+};
+
+
+/*
+ * Account one bus transaction that started at @start
+ */
+static void lcd_i2c_count(struct lcd_dev *lcd, bool read, u8 data, int ret, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+
+    atomic64_inc(read ? &lcd->stats.i2c_reads : &lcd->stats.i2c_writes);
+    if (ret < 0)
+        atomic64_inc(&lcd->stats.i2c_errors);
+    atomic64_add(ns, &lcd->stats.i2c_ns);
+    trace_lcd_i2c_xfer(lcd->dev_num, read, data, ret, ns);
+}
+
+/*
+ * Write a byte to the I2C device
+ */
+static void lcd_i2c_write_byte(void *priv, u8 data)
+{
+    struct lcd_dev *lcd = priv;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    /* Call the Linux Kernal API provided by the I2C subsystem.
+     * Sends a single byte over the physical I2C bus to the specified client address */
+    ret = i2c_smbus_write_byte(lcd->client, data);
+    lcd_i2c_count(lcd, false, data, ret, start);
+}
+
+/*
+ * Read the PCF8574 pins back from the I2C device
+ */
+static int lcd_i2c_read_byte(void *priv)
+{
+    struct lcd_dev *lcd = priv;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = i2c_smbus_read_byte(lcd->client);
+    lcd_i2c_count(lcd, true, ret < 0 ? 0 : ret, ret, start);
+    return ret;
+}
+
+/*
+ * Delays used by the protocol layer range from 1us to the 50ms power-on wait.
+ * udelay() is only meant for short waits, and the long ones happen at probe
+ * where sleeping is fine.
+ */
+static void lcd_delay_us(void *priv, unsigned int us)
+{
+    struct lcd_dev *lcd = priv;
+    u64 start = ktime_get_ns();
+
+    if (us >= 20000)
+        msleep(DIV_ROUND_UP(us, 1000));
+    else if (us >= 1000)
+        mdelay(DIV_ROUND_UP(us, 1000));
+    else
+        udelay(us);
+
+    atomic64_add(ktime_get_ns() - start, &lcd->stats.delay_ns);
+}
+
+static u64 lcd_now_ns(void *priv)
+{
+    return ktime_get_ns();
+}
+
+static const struct lcd_hd44780_ops lcd_i2c_ops = {
+    .write_byte = lcd_i2c_write_byte,
+    .read_byte = lcd_i2c_read_byte,
+    .delay_us = lcd_delay_us,
+    .now_ns = lcd_now_ns,
+};
+
+/*
+ * Free the display once the I2C device, the last file and the last mapping are gone
+ */
+static void lcd_free(struct kref *ref)
+{
+    struct lcd_dev *lcd = container_of(ref, struct lcd_dev, ref);
+
+    kfree(lcd->text);
+    free_page((unsigned long)lcd->fb);
+    mutex_destroy(&lcd->submit_lock);
+    mutex_destroy(&lcd->lock);
+    kfree(lcd);
+}
+
+static bool lcd_removed(struct lcd_dev *lcd)
+{
+    return READ_ONCE(lcd->removed);
+}
+
+/*
+ * Reset the grid after the controller cleared DDRAM
+ */
+static void lcd_clear(struct lcd_dev *lcd)
+{
+    lcd_hd44780_clear(&lcd->hd);
+    memset(lcd->fb, ' ', PAGE_SIZE);
+}
+
+/**
+ * lcd_fb_flush() - Push framebuffer cells that differ from the display
+ * @lcd: Pointer to the local device structure
  *
- * D7-D4 : LCD Data Bus (Sends High Nibble, then Low Nibble)
- * BL    : Backlight (1 = On, 0 = Off)
- * EN    : Enable (Pulse High->Low to latch data)
- * RW    : Read/Write (0 = Write)
- * RS    : Register Select (0 = Command, 1 = Data)
+ * User space may keep storing into the page while we work, so the protocol
+ * layer diffs one consistent snapshot of the grid against the display.
  *
- * 2. HD44780 INSTRUCTION SET FORMAT (Sent with RS=0)
- * -------------------------------------------------------------------------
- * Instruction               | D7  D6  D5  D4  D3  D2  D1  D0
- * --------------------------+-------------------------------
- * Clear Display             |  0   0   0   0   0   0   0   1
- * Return Home               |  0   0   0   0   0   0   1   -
- * Entry Mode Set            |  0   0   0   0   0   1  I/D  S
- * Display On/Off            |  0   0   0   0   1   D   C   B
- * Cursor/Display Shift      |  0   0   0   1  S/C R/L  -   -
- * Function Set              |  0   0   1   DL  N   F   -   -
- * Set CGRAM Address         |  0   1  ACG ACG ACG ACG ACG ACG
- * Set DDRAM Address         |  1  ADD ADD ADD ADD ADD ADD ADD
+ * Caller must hold lcd->lock.
+ */
+static void lcd_fb_flush(struct lcd_dev *lcd)
+{
+    char snap[LCD_MAX_ROWS * LCD_MAX_COLS];
+
+    memcpy(snap, lcd->fb, lcd->hd.rows * lcd->hd.cols);
+    lcd_hd44780_flush(&lcd->hd, snap);
+}
+
+/*
+ * Queue the next framebuffer refresh while user space has it mapped. Checked
+ * under queue_lock, so lcd_remove() never finds the work queued after it
+ * stopped it.
+ */
+static void lcd_refresh_schedule(struct lcd_dev *lcd)
+{
+    spin_lock(&lcd->queue_lock);
+    if (!lcd->removed && atomic_read(&lcd->fb_maps) > 0 && fb_refresh_ms)
+        queue_delayed_work(lcd->wq, &lcd->refresh_work, msecs_to_jiffies(fb_refresh_ms));
+    spin_unlock(&lcd->queue_lock);
+}
+
+/*
+ * Setting fb_refresh_ms restarts the refresh of displays that are mapped, which
+ * stopped rescheduling itself if the interval was 0
+ */
+static int lcd_refresh_ms_set(const char *val, const struct kernel_param *kp)
+{
+    struct lcd_dev *lcd;
+    int id;
+    int ret;
+
+    ret = param_set_uint(val, kp);
+    if (ret)
+        return ret;
+
+    mutex_lock(&lcd_minors_lock);
+    idr_for_each_entry(&lcd_minors, lcd, id)
+        lcd_refresh_schedule(lcd);
+    mutex_unlock(&lcd_minors_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops lcd_refresh_ms_ops = {
+    .set = lcd_refresh_ms_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(fb_refresh_ms, &lcd_refresh_ms_ops, &fb_refresh_ms, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fb_refresh_ms, "Framebuffer refresh interval in ms (0 = flush on request only)");
+
+/*
+ * Periodic refresh of the framebuffer while user space has it mapped
+ */
+static void lcd_refresh_work(struct work_struct *work)
+{
+    struct lcd_dev *lcd = container_of(to_delayed_work(work), struct lcd_dev, refresh_work);
+
+    mutex_lock(&lcd->lock);
+    lcd_fb_flush(lcd);
+    mutex_unlock(&lcd->lock);
+
+    lcd_refresh_schedule(lcd);
+}
+
+/*
+ * Render the current marquee window into its framebuffer row and push it out.
+ * Caller must hold lcd->lock.
+ */
+static void lcd_marquee_draw(struct lcd_dev *lcd)
+{
+    lcd_hd44780_marquee_window(lcd->marquee_text, lcd->marquee_len, lcd->marquee_pos,
+                               &lcd->fb[lcd->marquee_row * lcd->hd.cols], lcd->hd.cols);
+    lcd_fb_flush(lcd);
+}
+
+/*
+ * Advance the marquee by the number of steps the timer counted. If a redraw
+ * took longer than one interval the marquee jumps ahead rather than drifting
+ * behind the requested speed.
+ */
+static void lcd_marquee_work(struct work_struct *work)
+{
+    struct lcd_dev *lcd = container_of(work, struct lcd_dev, marquee_work);
+    unsigned int steps;
+
+    mutex_lock(&lcd->lock);
+    /* The marquee may have been stopped or replaced after the timer queued us */
+    steps = atomic_xchg(&lcd->marquee_steps, 0);
+    if (lcd->marquee_len && steps) {
+        lcd->marquee_pos = (lcd->marquee_pos + steps) % (lcd->marquee_len + LCD_MARQUEE_GAP);
+        lcd_marquee_draw(lcd);
+    }
+    mutex_unlock(&lcd->lock);
+}
+
+/*
+ * Marquee step timer. Runs in hard interrupt context, so it only counts the
+ * elapsed periods and leaves the I2C traffic to the work item. Forwarding
+ * from the previous expiry keeps the step cadence free of accumulated drift.
+ */
+static enum hrtimer_restart lcd_marquee_timer_fn(struct hrtimer *timer)
+{
+    struct lcd_dev *lcd = container_of(timer, struct lcd_dev, marquee_timer);
+    u64 overruns = hrtimer_forward_now(timer, lcd->marquee_interval);
+
+    atomic_add(overruns, &lcd->marquee_steps);
+    queue_work(lcd->wq, &lcd->marquee_work);
+    return HRTIMER_RESTART;
+}
+
+/**
+ * lcd_marquee_set() - Start, replace or stop the marquee
+ * @lcd: Pointer to the local device structure
+ * @m: Marquee request, already checked by lcd_marquee_valid()
  *
- * Legend:
- * I/D=Inc/Dec, S=Shift, D=Disp On, C=Curs On, B=Blink,
- * DL=DataLen (0=4bit), N=Lines, F=Font, ACG=CGRAM, ADD=DDRAM
+ * A queued marquee_work that runs after the timer was cancelled finds
+ * marquee_len at 0 (or the new message) and does the right thing, so the work
+ * does not need to be cancelled here, which could not be done under the lock.
  *
- * 3. EXAMPLE 1: Sending Data (Letter 'A' -> 0x41)
- * -------------------------------------------------------------------------
- * Character 'A' binary: 0100 0001
- * Context: RS=1 (Data), RW=0 (Write), BL=1 (Backlight On)
+ * Caller must hold lcd->lock.
+ */
+static void lcd_marquee_set(struct lcd_dev *lcd, const struct lcd_marquee *m)
+{
+    hrtimer_cancel(&lcd->marquee_timer);
+    lcd->marquee_len = 0;
+
+    if (m->interval_ms == 0)
+        return;
+
+    memcpy(lcd->marquee_text, m->text, m->len);
+    lcd->marquee_len = m->len;
+    lcd->marquee_row = m->row;
+    lcd->marquee_pos = 0;
+    lcd->marquee_interval = ms_to_ktime(m->interval_ms);
+    atomic_set(&lcd->marquee_steps, 0);
+
+    lcd_marquee_draw(lcd);
+    hrtimer_start(&lcd->marquee_timer, lcd->marquee_interval, HRTIMER_MODE_REL);
+}
+
+/*
+ * Check a marquee request before it is queued, so that errors reach the caller
+ */
+static bool lcd_marquee_valid(const struct lcd_dev *lcd, const struct lcd_marquee *m)
+{
+    if (m->interval_ms == 0)
+        return true;
+
+    return m->row >= 0 && m->row < lcd->hd.rows && m->interval_ms > 0 &&
+           m->len > 0 && m->len <= LCD_MARQUEE_MAX_LEN;
+}
+
+/* ---------- Command queue ---------- */
+
+/*
+ * Send @len bytes of queued text, the oldest in the ring. Text that wraps
+ * around the end of the ring goes out in two pieces, which
+ * lcd_hd44780_write() continues seamlessly.
+ * Caller must hold lcd->lock.
+ */
+static void lcd_text_exec(struct lcd_dev *lcd, size_t len)
+{
+    unsigned int off = lcd->text_tail & (LCD_TEXT_RING_SIZE - 1);
+    size_t first = min_t(size_t, len, LCD_TEXT_RING_SIZE - off);
+
+    lcd_hd44780_write(&lcd->hd, lcd->text + off, first, lcd->fb);
+    if (len > first)
+        lcd_hd44780_write(&lcd->hd, lcd->text, len - first, lcd->fb);
+}
+
+/**
+ * lcd_cmd_exec() - Execute one command on the display
+ * @lcd: Pointer to the local device structure
+ * @cmd: The command
  *
- * -- PASS 1: High Nibble (0100) --
- * 1. Setup: D7..4=0100, EN=1, RS=1. Byte: 0100 1101 (0x4D) -> Prepare Latch
- * 2. Latch: D7..4=0100, EN=0, RS=1. Byte: 0100 1001 (0x49) -> Execute
+ * Caller must hold lcd->lock.
+ */
+static void lcd_cmd_exec(struct lcd_dev *lcd, struct lcd_cmd *cmd)
+{
+    unsigned long arg = cmd->arg;
+
+    switch (cmd->op) {
+        case LCD_OP_WRITE:
+            lcd_text_exec(lcd, cmd->len);
+            break;
+        case LCD_CLEAR:
+            /* Clear display command: writes space code 0x20 to all DDRAM addresses */
+            lcd_clear(lcd);
+            break;
+
+        case LCD_HOME:
+            /* Return Home command: Sets DDRAM address 0 in address counter.
+             * Returns display from being shifted to original position. */
+            lcd_hd44780_home(&lcd->hd);
+            break;
+            
+        case LCD_SET_CURSOR:
+            /* Decode the argument: High 8 bits = Row, Low 8 bits = Column.
+             * 'arg' contains the integer value directly. */
+            lcd_hd44780_set_cursor(&lcd->hd, (arg >> 8) & 0xFF, arg & 0xFF);
+            break;
+            
+        case LCD_BACKLIGHT:
+            /* Toggle the backlight bit and update the I2C expander immediately */
+            lcd_hd44780_set_backlight(&lcd->hd, arg);
+            break;
+
+        case LCD_DISPLAY_SWITCH:
+            /* Modify the Display ON/OFF bit in the control register */
+            lcd_hd44780_set_display_ctrl(&lcd->hd, LCD_DISPLAY_ON, arg);
+            break;
+
+        case LCD_CURSOR_SWITCH:
+            /* Modify the Cursor ON/OFF bit (underline) */
+            lcd_hd44780_set_display_ctrl(&lcd->hd, LCD_CURSOR_ON, arg);
+            break;
+
+        case LCD_BLINK_SWITCH:
+            /* Modify the Blink ON/OFF bit (blinking block) */
+            lcd_hd44780_set_display_ctrl(&lcd->hd, LCD_BLINK_ON, arg);
+            break;
+
+        case LCD_SCROLL:
+            /* Shift the display window left or right.
+             * Note: This moves the viewport, not the data in RAM. */
+            if (arg == LCD_SCROLL_LEFT)
+                lcd_hd44780_command(&lcd->hd, LCD_CMD_SHIFT | LCD_DISPLAY_MOVE | LCD_MOVE_LEFT);
+            else
+                lcd_hd44780_command(&lcd->hd, LCD_CMD_SHIFT | LCD_DISPLAY_MOVE | LCD_MOVE_RIGHT);
+            break;
+
+        case LCD_TEXT_DIR:
+            /* Set text entry mode: Left-to-Right or Right-to-Left */
+            lcd_hd44780_set_entry_mode(&lcd->hd, LCD_ENTRY_LEFT, arg == LCD_TEXT_LTR);
+            break;
+
+        case LCD_AUTOSCROLL:
+            /* Set text entry mode: Auto-shift (autoscroll) enable/disable */
+            lcd_hd44780_set_entry_mode(&lcd->hd, LCD_ENTRY_SHIFT_INC, arg);
+            break;
+
+        case LCD_MARQUEE:
+            lcd_marquee_set(lcd, (const struct lcd_marquee *)arg);
+            break;
+    }
+}
+
+/*
+ * Commands whose whole effect is undone by a following Clear Display, which
+ * rewrites DDRAM, resets the address counter and undoes any display shift
+ */
+static bool lcd_cmd_cleared(const struct lcd_cmd *cmd)
+{
+    switch (cmd->op) {
+        case LCD_OP_WRITE:
+        case LCD_CLEAR:
+        case LCD_HOME:
+        case LCD_SET_CURSOR:
+        case LCD_SCROLL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Return a command to the pool once it left the queue.
+ * Caller must hold lcd->queue_lock.
+ */
+static void lcd_cmd_put(struct lcd_dev *lcd, struct lcd_cmd *cmd)
+{
+    if (cmd->op == LCD_MARQUEE)
+        kfree((void *)cmd->arg);
+    list_add(&cmd->list, &lcd->cmd_free);
+}
+
+/**
+ * lcd_queue_merge() - Fold a new command into the end of the queue
+ * @lcd: Pointer to the local device structure
+ * @op: The command being submitted
+ * @arg: Its ioctl argument
+ * @len: Its text length, for LCD_OP_WRITE
+ * @seq: Its sequence number
  *
- * -- PASS 2: Low Nibble (0001) --
- * 3. Setup: D7..4=0001, EN=1, RS=1. Byte: 0001 1101 (0x1D) -> Prepare Latch
- * 4. Latch: D7..4=0001, EN=0, RS=1. Byte: 0001 1001 (0x19) -> Execute
+ * Only commands that have not been picked up by the consumer are touched, and
+ * only where the display ends up exactly as if everything had run in order:
+ * - text written right after text is appended to it, the ring already holds
+ *   the new text right behind the old,
+ * - a setting changed again right after the last change only applies the new value,
+ * - text, cursor moves, scrolling and clears right before a clear are dropped,
+ *   along with their text, which is the newest in the ring.
  *
- * I2C Stream: 0x4D, 0x49, 0x1D, 0x19
+ * Caller must hold lcd->queue_lock.
  *
- * 4. EXAMPLE 2: Sending Command (Clear Display -> 0x01)
- * -------------------------------------------------------------------------
- * Instruction Code: 0000 0001
- * Context: RS=0 (Command), RW=0 (Write), BL=1 (Backlight On)
- * IMPORTANT: "Clear Display" is slow! Must wait >1.52ms after sending.
+ * Return: true if the command was absorbed and needs no queue entry
+ */
+static bool lcd_queue_merge(struct lcd_dev *lcd, unsigned int op, unsigned long arg,
+                            size_t len, u64 seq)
+{
+    struct lcd_cmd *tail;
+
+    if (op == LCD_CLEAR) {
+        while (!list_empty(&lcd->queue)) {
+            tail = list_last_entry(&lcd->queue, struct lcd_cmd, list);
+            if (!lcd_cmd_cleared(tail))
+                break;
+            if (tail->op == LCD_OP_WRITE)
+                lcd->text_head -= tail->len;
+            list_del(&tail->list);
+            lcd_cmd_put(lcd, tail);
+            lcd->queued_cmds--;
+            atomic64_inc(&lcd->stats.cleared);
+        }
+        return false;
+    }
+
+    if (list_empty(&lcd->queue))
+        return false;
+    tail = list_last_entry(&lcd->queue, struct lcd_cmd, list);
+    if (tail->op != op)
+        return false;
+
+    switch (op) {
+        case LCD_OP_WRITE:
+            tail->len += len;
+            break;
+
+        case LCD_SET_CURSOR:
+        case LCD_BACKLIGHT:
+        case LCD_DISPLAY_SWITCH:
+        case LCD_CURSOR_SWITCH:
+        case LCD_BLINK_SWITCH:
+        case LCD_TEXT_DIR:
+        case LCD_AUTOSCROLL:
+            tail->arg = arg;
+            break;
+
+        default:
+            return false;
+    }
+
+    tail->seq = seq;
+    return true;
+}
+
+static bool lcd_queue_has_room(struct lcd_dev *lcd)
+{
+    bool room;
+
+    spin_lock(&lcd->queue_lock);
+    room = !list_empty(&lcd->cmd_free) || lcd->removed;
+    spin_unlock(&lcd->queue_lock);
+    return room;
+}
+
+/*
+ * Free bytes in the text ring. Only the holder of submit_lock adds text, so
+ * the space found here stays free until that caller commits it.
+ */
+static unsigned int lcd_text_room(struct lcd_dev *lcd)
+{
+    unsigned int used;
+
+    spin_lock(&lcd->queue_lock);
+    used = lcd->text_head - lcd->text_tail;
+    spin_unlock(&lcd->queue_lock);
+    return LCD_TEXT_RING_SIZE - used;
+}
+
+/*
+ * Count a command by type as it is submitted. Text is counted once per
+ * write() by lcd_write(), however many ring chunks it was queued in.
+ */
+static void lcd_stats_cmd(struct lcd_dev *lcd, unsigned int op)
+{
+    atomic64_inc(&lcd->stats.cmds[_IOC_NR(op)]);
+}
+
+/*
+ * Take submit_lock, or fail right away for O_NONBLOCK callers
+ */
+static int lcd_submit_lock(struct lcd_dev *lcd, bool nonblock)
+{
+    if (nonblock)
+        return mutex_trylock(&lcd->submit_lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(&lcd->submit_lock))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/**
+ * lcd_queue_submit() - Hand a command to the queue consumer
+ * @lcd: Pointer to the local device structure
+ * @op: LCD_OP_WRITE or the ioctl command number
+ * @arg: ioctl argument, owned by the queue from here on for LCD_MARQUEE
+ * @len: For LCD_OP_WRITE, bytes of text the caller placed at lcd->text_head
+ * @nonblock: Fail with -EAGAIN instead of waiting for a free command
  *
- * -- PASS 1: High Nibble (0000) --
- * 1. Setup: D7..4=0000, EN=1, RS=0. Byte: 0000 1100 (0x0C) -> Prepare Latch
- * 2. Latch: D7..4=0000, EN=0, RS=0. Byte: 0000 1000 (0x08) -> Execute
+ * Commands execute in submission order, so the order of the operations of
+ * every opener is preserved without any locking in user space. Nothing is
+ * allocated here: the command comes from the pool of the device, and a
+ * command merged into the queue tail does not need one at all.
  *
- * -- PASS 2: Low Nibble (0001) --
- * 3. Setup: D7..4=0001, EN=1, RS=0. Byte: 0001 1100 (0x1C) -> Prepare Latch
- * 4. Latch: D7..4=0001, EN=0, RS=0. Byte: 0001 1000 (0x18) -> Execute
+ * Caller must hold lcd->submit_lock.
  *
- * I2C Stream: 0x0C, 0x08, 0x1C, 0x18 -> then Sleep(2)
+ * Return: 0 on success, -EAGAIN, -ERESTARTSYS or -ENODEV if the command was not queued
  */
+static int lcd_queue_submit(struct lcd_dev *lcd, unsigned int op, unsigned long arg,
+                            size_t len, bool nonblock)
+{
+    struct lcd_cmd *cmd;
+    bool merged;
+    u64 seq;
 
+    spin_lock(&lcd->queue_lock);
+    for (;;) {
+        if (lcd->removed) {
+            spin_unlock(&lcd->queue_lock);
+            return -ENODEV;
+        }
 
-/* Define the maximum IOCTL command number for validation checks.
- * Currently 10 commands are defined in aesdlcd_ioctl.h */
-#define LCD_IOC_MAXNR 10
-
-/* PCF8574 Pin Definitions */
-#define LCD_RS_BIT      (1 << 0)
-#define LCD_RW_BIT      (1 << 1)
-#define LCD_EN_BIT      (1 << 2)
-#define LCD_BL_BIT      (1 << 3)
-#define LCD_D4_BIT      (1 << 4)
-#define LCD_D5_BIT      (1 << 5)
-#define LCD_D6_BIT      (1 << 6)
-#define LCD_D7_BIT      (1 << 7)
-
-/* LCD Commands */
-#define LCD_CMD_CLEAR           0x01
-#define LCD_CMD_RETURN_HOME     0x02
-#define LCD_CMD_ENTRY_MODE      0x04
-#define LCD_CMD_DISPLAY_CTRL    0x08
-#define LCD_CMD_SHIFT           0x10
-#define LCD_CMD_FUNCTION_SET    0x20
-#define LCD_CMD_SET_CGRAM_ADDR  0x40
-#define LCD_CMD_SET_DDRAM_ADDR  0x80
-
-/* Flags for display entry mode */
-#define LCD_ENTRY_RIGHT         0x00
-#define LCD_ENTRY_LEFT          0x02
-#define LCD_ENTRY_SHIFT_INC     0x01
-#define LCD_ENTRY_SHIFT_DEC     0x00
-
-/* Flags for display on/off control */
-#define LCD_DISPLAY_ON          0x04
-#define LCD_DISPLAY_OFF         0x00
-#define LCD_CURSOR_ON           0x02
-#define LCD_CURSOR_OFF          0x00
-#define LCD_BLINK_ON            0x01
-#define LCD_BLINK_OFF           0x00
-
-/* Flags for display/cursor shift */
-#define LCD_DISPLAY_MOVE        0x08
-#define LCD_CURSOR_MOVE         0x00
-#define LCD_MOVE_RIGHT          0x04
-#define LCD_MOVE_LEFT           0x00
-
-/* Flags for function set */
-#define LCD_8BIT_MODE           0x10
-#define LCD_4BIT_MODE           0x00
-#define LCD_2LINE               0x08
-#define LCD_1LINE               0x00
-#define LCD_5x10DOTS            0x04
-#define LCD_5x8DOTS             0x00
+        /* A clear that drops commands always leaves a free one behind, so
+         * it cannot fail after changing the queue */
+        seq = lcd->queued_seq + 1;
+        merged = lcd_queue_merge(lcd, op, arg, len, seq);
+        if (merged)
+            break;
+        cmd = list_first_entry_or_null(&lcd->cmd_free, struct lcd_cmd, list);
+        if (cmd)
+            break;
 
+        spin_unlock(&lcd->queue_lock);
+        if (nonblock)
+            return -EAGAIN;
+        if (wait_event_interruptible(lcd->queue_wait, lcd_queue_has_room(lcd)))
+            return -ERESTARTSYS;
+        spin_lock(&lcd->queue_lock);
+    }
 
-MODULE_LICENSE("Dual BSD/GPL");
-MODULE_AUTHOR("Scott Karl");
-MODULE_DESCRIPTION("AESD I2C LCD Driver for Raspberry Pi");
+    if (op == LCD_OP_WRITE)
+        lcd->text_head += len;
+    lcd->queued_seq = seq;
+    if (op != LCD_OP_WRITE)
+        lcd_stats_cmd(lcd, op);
+    trace_lcd_cmd_submit(lcd->dev_num, seq, op, len, merged);
 
-/**
- * struct lcd_dev - Internal device structure
- * @client: Pointer to the I2C client struct provided by the kernel
- * @cdev: Character device structure for kernel registration
- * @class: Class structure for sysfs registration
- * @dev_num: The major/minor device number
- * @backlight_state: The state of the backlight (ON/OFF bit)
- * @display_ctrl: The Display/Cursor/Blink command bits
- * @display_mode: The Entry Mode (text direction/autoscroll) bits
- */
-struct lcd_dev {
-    struct i2c_client *client;
-    struct cdev cdev;
-    struct class *class;
-    dev_t dev_num;
-    u8 backlight_state;
-    u8 display_ctrl;
-    u8 display_mode;
-};
+    if (merged) {
+        /* The consumer is already scheduled for the tail */
+        spin_unlock(&lcd->queue_lock);
+        atomic64_inc(&lcd->stats.merged);
+        return 0;
+    }
+
+    cmd->seq = seq;
+    cmd->op = op;
+    cmd->arg = arg;
+    cmd->len = len;
+    list_move_tail(&cmd->list, &lcd->queue);
+    lcd->queued_cmds++;
+    if (lcd->queued_cmds > lcd->stats.queue_depth_max)
+        lcd->stats.queue_depth_max = lcd->queued_cmds;
+
+    /* Under queue_lock, so lcd_remove() never finds the work queued after
+     * it stopped the consumer */
+    queue_work(lcd->wq, &lcd->queue_work);
+    spin_unlock(&lcd->queue_lock);
+    return 0;
+}
+
+static bool lcd_queue_done(struct lcd_dev *lcd, u64 seq)
+{
+    bool done;
+
+    spin_lock(&lcd->queue_lock);
+    done = lcd->done_seq >= seq || lcd->removed;
+    spin_unlock(&lcd->queue_lock);
+    return done;
+}
 
 /*
- * Write a byte to the I2C device
+ * Drop commands that never ran, once the consumer has been stopped
  */
-static void lcd_i2c_write_byte(struct lcd_dev *lcd, u8 data)
+static void lcd_queue_free(struct lcd_dev *lcd)
 {
-    /* Call the Linux Kernal API provided by the I2C subsystem.
-     * Sends a single byte over the physical I2C bus to the specified client address */
-    i2c_smbus_write_byte(lcd->client, data);
+    struct lcd_cmd *cmd, *tmp;
+
+    list_for_each_entry_safe(cmd, tmp, &lcd->queue, list) {
+        list_del(&cmd->list);
+        lcd_cmd_put(lcd, cmd);
+    }
+    lcd->text_tail = lcd->text_head;
+    lcd->queued_cmds = 0;
 }
 
-/*
- * Pulse the Enable bit to latch data
+/**
+ * lcd_queue_sync_lock() - Wait for everything submitted so far, then lock the bus
+ * @lcd: Pointer to the local device structure
+ *
+ * For operations that return a result or promise the display is up to date
+ * when they return. Commands submitted by others in the meantime do not delay
+ * the caller.
+ *
+ * Return: 0 with lcd->lock held, -ERESTARTSYS, or -ENODEV once the display is gone
  */
-static void lcd_pulse_enable(struct lcd_dev *lcd, u8 data)
+static int lcd_queue_sync_lock(struct lcd_dev *lcd)
 {
-    lcd_i2c_write_byte(lcd, data | LCD_EN_BIT);
-    udelay(1);
-    lcd_i2c_write_byte(lcd, data & ~LCD_EN_BIT);
-    udelay(50);
-}
+    u64 seq;
 
-/*
- * Send a nibble (4 bits) to the LCD.
- * 
- * The HD44780 datasheet states that in 4-bit mode, data is sent to the 
- * top 4 pins of the data bus (pins 4 through 7).
- * 
- * @nibble: The byte containing the data in the upper 4 bits (MSB).
- *          The lower 4 bits are masked out.
- * @rs:     Register Select (0=Command, 1=Data).
- * 
- * NOTE:
- * The kernel function i2c_smbus_write_byte() executes a COMPLETE I2C transaction
- * for every call: [START] [ADDR] [DATA] [STOP].
- * * To latch a single 4-bit nibble into the LCD, this driver performs THREE 
- * separate I2C writes. Crucially, the data nibble (bits 4-7) is sent 
- * IDENTICALLY three times to ensure the data pins are stable while the 
- * Enable pin (bit 2) is toggled:
- * 1. Setup: [Nibble | EN=0] -> Stabilizes D4-D7 pins (Nibble sent 1st time)
- * 2. Pulse: [Nibble | EN=1] -> Latch data           (Nibble sent 2nd time)
- * 3. Hold:  [Nibble | EN=0] -> Complete pulse       (Nibble sent 3rd time)
- */
-static void lcd_send_nibble(struct lcd_dev *lcd, u8 nibble, u8 rs)
-{
-    u8 data = (nibble & 0xF0) | rs | lcd->backlight_state;
-    lcd_i2c_write_byte(lcd, data);
-    lcd_pulse_enable(lcd, data);
+    spin_lock(&lcd->queue_lock);
+    seq = lcd->queued_seq;
+    spin_unlock(&lcd->queue_lock);
+
+    if (wait_event_interruptible(lcd->queue_wait, lcd_queue_done(lcd, seq)))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&lcd->lock))
+        return -ERESTARTSYS;
+    if (lcd->removed) {
+        mutex_unlock(&lcd->lock);
+        return -ENODEV;
+    }
+    return 0;
 }
 
 /*
- * Send a full byte to the LCD (split into two nibbles)
+ * The single consumer of the queue. A work item never runs concurrently with
+ * itself, so commands leave the queue one at a time and in order, and the
+ * text of each write is found at the tail of the ring.
  */
-static void lcd_send_byte(struct lcd_dev *lcd, u8 byte, u8 rs)
+static void lcd_queue_work(struct work_struct *work)
 {
-    u8 high_nibble = byte & 0xF0;
-    u8 low_nibble = (byte << 4) & 0xF0;
-    
-    lcd_send_nibble(lcd, high_nibble, rs);
-    lcd_send_nibble(lcd, low_nibble, rs);
+    struct lcd_dev *lcd = container_of(work, struct lcd_dev, queue_work);
+    struct lcd_cmd *cmd;
+
+    for (;;) {
+        spin_lock(&lcd->queue_lock);
+        cmd = list_first_entry_or_null(&lcd->queue, struct lcd_cmd, list);
+        if (!cmd) {
+            spin_unlock(&lcd->queue_lock);
+            break;
+        }
+        list_del(&cmd->list);
+        lcd->queued_cmds--;
+        spin_unlock(&lcd->queue_lock);
+
+        trace_lcd_cmd_start(lcd->dev_num, cmd->seq, cmd->op);
+        mutex_lock(&lcd->lock);
+        lcd_cmd_exec(lcd, cmd);
+        mutex_unlock(&lcd->lock);
+        trace_lcd_cmd_done(lcd->dev_num, cmd->seq, cmd->op);
+
+        spin_lock(&lcd->queue_lock);
+        if (cmd->op == LCD_OP_WRITE)
+            lcd->text_tail += cmd->len;
+        lcd->done_seq = cmd->seq;
+        lcd_cmd_put(lcd, cmd);
+        spin_unlock(&lcd->queue_lock);
+        wake_up_interruptible(&lcd->queue_wait);
+    }
 }
 
 /*
- * Send a command to the LCD
+ * Every open file holds a reference to its display, so the display can be
+ * unbound while it is open
  */
-static void lcd_command(struct lcd_dev *lcd, u8 cmd)
+static int lcd_open(struct inode *inode, struct file *file)
+{
+    struct lcd_dev *lcd;
+
+    mutex_lock(&lcd_minors_lock);
+    lcd = idr_find(&lcd_minors, iminor(inode));
+    if (lcd)
+        kref_get(&lcd->ref);
+    mutex_unlock(&lcd_minors_lock);
+
+    if (!lcd)
+        return -ENODEV;
+    file->private_data = lcd;
+    return 0;
+}
+
+static int lcd_release(struct inode *inode, struct file *file)
 {
-    lcd_send_byte(lcd, cmd, 0);
+    struct lcd_dev *lcd = file->private_data;
+
+    kref_put(&lcd->ref, lcd_free);
+    return 0;
 }
 
 /*
- * Send data to the LCD
+ * Every mapping holds a reference too, so @fb stays valid until it is unmapped
  */
-static void lcd_data(struct lcd_dev *lcd, u8 data)
+static void lcd_vma_open(struct vm_area_struct *vma)
+{
+    struct lcd_dev *lcd = vma->vm_private_data;
+
+    kref_get(&lcd->ref);
+    atomic_inc(&lcd->fb_maps);
+}
+
+static void lcd_vma_close(struct vm_area_struct *vma)
 {
-    lcd_send_byte(lcd, data, LCD_RS_BIT);
+    struct lcd_dev *lcd = vma->vm_private_data;
+
+    atomic_dec(&lcd->fb_maps);
+    kref_put(&lcd->ref, lcd_free);
 }
 
+static const struct vm_operations_struct lcd_vm_ops = {
+    .open = lcd_vma_open,
+    .close = lcd_vma_close,
+};
+
 /**
- * lcd_init_sequence() - Runs the HD44780 initialization logic
- * @lcd: Pointer to the local device structure
+ * lcd_mmap() - Map the character framebuffer into user space
+ * @file: File pointer providing access to the device private data
+ * @vma: The user space region being mapped
+ *
+ * The framebuffer is a single kernel page, so only shared mappings at offset 0
+ * with lengths of up to one page are accepted. Starts the periodic refresh work, which keeps
+ * rescheduling itself for as long as at least one mapping exists.
  *
- * Implements the specific 4-bit initialization procedure required by the 
- * controller datasheet. Sets default state (Display On, Cursor Off, etc.).
+ * Return: 0 on success, negative error code on failure
  */
-static void lcd_init_sequence(struct lcd_dev *lcd)
+static int lcd_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    /* Wait for more than 40ms after VCC rises to 2.7V. */
-    msleep(50);
+    struct lcd_dev *lcd = file->private_data;
+    int ret;
 
-    /* Initialization sequence for 4-bit mode */
-    lcd_send_nibble(lcd, 0x30, 0);
-    mdelay(5); 
-    
-    lcd_send_nibble(lcd, 0x30, 0);
-    mdelay(5); 
-    
-    lcd_send_nibble(lcd, 0x30, 0);
-    udelay(150); 
-    
-    /* Finally, set to 4-bit interface */
-    lcd_send_nibble(lcd, 0x20, 0); 
+    if (lcd_removed(lcd))
+        return -ENODEV;
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
 
-    /* Function set: 4-bit, 2 line, 5x8 dots */
-    lcd_command(lcd, LCD_CMD_FUNCTION_SET | LCD_4BIT_MODE | LCD_2LINE | LCD_5x8DOTS);
-    
-    /* Default: Display on, Cursor off, Blink off */
-    lcd->display_ctrl = LCD_DISPLAY_ON | LCD_CURSOR_OFF | LCD_BLINK_OFF;
-    lcd_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
-    
-    /* Clear display */
-    lcd_command(lcd, LCD_CMD_CLEAR);
-    mdelay(2);
-    
-    /* Default Entry mode: Increment cursor, no shift */
-    lcd->display_mode = LCD_ENTRY_LEFT | LCD_ENTRY_SHIFT_DEC;
-    lcd_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
-    
-    /* Return home */
-    lcd_command(lcd, LCD_CMD_RETURN_HOME);
-    mdelay(2);
-}
+    /* A private mapping would copy-on-write away from the page we refresh from */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
 
-static int lcd_open(struct inode *inode, struct file *file)
-{
-    struct lcd_dev *lcd = container_of(inode->i_cdev, struct lcd_dev, cdev);
-    file->private_data = lcd;
+    ret = vm_insert_page(vma, vma->vm_start, virt_to_page(lcd->fb));
+    if (ret)
+        return ret;
+
+    vma->vm_private_data = lcd;
+    vma->vm_ops = &lcd_vm_ops;
+    lcd_vma_open(vma);
+
+    lcd_refresh_schedule(lcd);
     return 0;
 }
 
-static int lcd_release(struct inode *inode, struct file *file)
+/*
+ * fsync() waits for queued writes and ioctls to reach the display, and together
+ * with msync(MS_SYNC) on a mapping pushes the framebuffer out immediately
+ */
+static int lcd_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
+    struct lcd_dev *lcd = file->private_data;
+    int ret;
+
+    ret = lcd_queue_sync_lock(lcd);
+    if (ret)
+        return ret;
+    lcd_fb_flush(lcd);
+    mutex_unlock(&lcd->lock);
     return 0;
 }
 
@@ -298,36 +1005,74 @@ static int lcd_release(struct inode *inode, struct file *file)
  * @count: Number of bytes to write
  * @ppos: File offset (ignored for this character device)
  *
- * Copies data from user space to kernel space and sends it byte-by-byte
- * to the LCD. Note that we allocate a kernel buffer to ensure safe access.
+ * Copies data from user space into the staging ring of the device and queues
+ * it for the display, without allocating. Writes of any size are taken in
+ * full, in pieces as the ring drains; with O_NONBLOCK only what fits right
+ * now is taken. The text is sent byte-by-byte to the LCD once the commands
+ * submitted before it are done; use fsync() to wait for that.
+ * '\n' and '\r' move to the start of the next/current row, and text reaching
+ * the end of a row continues on the next one, so several lines can be
+ * updated with a single write.
+ * Characters landing in the visible area are mirrored into the framebuffer
+ * so that the next refresh does not paint over them.
  *
  * Return: Number of bytes written on success, or negative error code
  */
 static ssize_t lcd_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
     struct lcd_dev *lcd = file->private_data;
-    char *kbuf;
-    int i;
-    
-    /* Limit write size to prevent excessive kernel memory allocation */
-    if (count > 4096)
-        count = 4096;
+    bool nonblock = file->f_flags & O_NONBLOCK;
+    size_t done = 0;
+    int ret;
 
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
-        
-    if (copy_from_user(kbuf, buf, count)) {
-        kfree(kbuf);
-        return -EFAULT;
-    }
-    
-    for (i = 0; i < count; i++) {
-        lcd_data(lcd, kbuf[i]);
+    if (lcd_removed(lcd))
+        return -ENODEV;
+    ret = lcd_submit_lock(lcd, nonblock);
+    if (ret)
+        return ret;
+
+    while (done < count) {
+        unsigned int room = lcd_text_room(lcd);
+        unsigned int off;
+        size_t chunk;
+
+        if (!room) {
+            if (lcd_removed(lcd)) {
+                ret = -ENODEV;
+                break;
+            }
+            if (nonblock) {
+                ret = -EAGAIN;
+                break;
+            }
+            if (wait_event_interruptible(lcd->queue_wait,
+                                         lcd_text_room(lcd) || lcd_removed(lcd))) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        /* Copy up to the end of the ring, the rest goes in the next round
+         * and is merged into the same command */
+        off = lcd->text_head & (LCD_TEXT_RING_SIZE - 1);
+        chunk = min3(count - done, (size_t)room, (size_t)(LCD_TEXT_RING_SIZE - off));
+        if (copy_from_user(lcd->text + off, buf + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = lcd_queue_submit(lcd, LCD_OP_WRITE, 0, chunk, nonblock);
+        if (ret)
+            break;
+        done += chunk;
     }
-    
-    kfree(kbuf);
-    return count;
+    mutex_unlock(&lcd->submit_lock);
+
+    if (done)
+        lcd_stats_cmd(lcd, LCD_OP_WRITE);
+    atomic64_add(done, &lcd->stats.text_bytes);
+    return done ? done : ret;
 }
 
 /**
@@ -345,11 +1090,18 @@ static ssize_t lcd_write(struct file *file, const char __user *buf, size_t count
  * - Scrolling text
  * - Loading Custom Characters
  *
+ * Commands that only change the display are queued behind earlier writes and
+ * return right away. LCD_LOAD_GLYPH and LCD_FB_FLUSH wait for the queue to
+ * drain up to their own submission and then run directly.
+ *
  * Return: 0 on success, negative error code on failure (e.g., -ENOTTY, -EFAULT)
  */
 static long lcd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct lcd_dev *lcd = file->private_data;
+    bool nonblock = file->f_flags & O_NONBLOCK;
+    struct lcd_marquee *m;
+    int ret;
     
     /* Verify that the ioctl command is valid for this driver.
      * The ioctl command number is encoded with several fields using _IOC() macro:
@@ -361,115 +1113,87 @@ static long lcd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
      * to indicate "this ioctl command doesn't belong to this driver". */
     if (_IOC_TYPE(cmd) != LCD_IOC_MAGIC) return -ENOTTY;
     if (_IOC_NR(cmd) > LCD_IOC_MAXNR) return -ENOTTY;
-    
+    if (lcd_removed(lcd)) return -ENODEV;
+
     switch (cmd) {
-        case LCD_CLEAR:
-            /* Clear display command: writes space code 0x20 to all DDRAM addresses */
-            lcd_command(lcd, LCD_CMD_CLEAR);
-            /* This command requires > 1.52ms execution time according to datasheet */
-            mdelay(2);
-            break;
+        case LCD_GET_GEOMETRY: {
+            /* Geometry is fixed after probe, no need to wait for the bus */
+            int geometry = (lcd->hd.rows << 8) | lcd->hd.cols;
 
+            if (put_user(geometry, (int __user *)arg))
+                return -EFAULT;
+            return 0;
+        }
+
+        case LCD_LOAD_GLYPH: {
+            /* The caller needs the slot, so this one cannot be queued */
+            struct lcd_glyph glyph;
+
+            if (copy_from_user(&glyph, (void __user *)arg, sizeof(glyph)))
+                return -EFAULT;
+
+            lcd_stats_cmd(lcd, cmd);
+            ret = lcd_queue_sync_lock(lcd);
+            if (ret)
+                return ret;
+            glyph.code = lcd_hd44780_load_glyph(&lcd->hd, glyph.bitmap);
+            mutex_unlock(&lcd->lock);
+
+            if (put_user(glyph.code, &((struct lcd_glyph __user *)arg)->code))
+                return -EFAULT;
+            return 0;
+        }
+
+        case LCD_FB_FLUSH:
+            /* Push the mmap() grid out now instead of waiting for the refresh */
+            lcd_stats_cmd(lcd, cmd);
+            ret = lcd_queue_sync_lock(lcd);
+            if (ret)
+                return ret;
+            lcd_fb_flush(lcd);
+            mutex_unlock(&lcd->lock);
+            return 0;
+
+        case LCD_MARQUEE:
+            /* Copy and check the marquee message now, errors must reach the caller */
+            m = memdup_user((void __user *)arg, sizeof(*m));
+            if (IS_ERR(m))
+                return PTR_ERR(m);
+            if (!lcd_marquee_valid(lcd, m)) {
+                kfree(m);
+                return -EINVAL;
+            }
+
+            ret = lcd_submit_lock(lcd, nonblock);
+            if (!ret) {
+                ret = lcd_queue_submit(lcd, cmd, (unsigned long)m, 0, nonblock);
+                mutex_unlock(&lcd->submit_lock);
+            }
+            if (ret)
+                kfree(m);
+            return ret;
+
+        case LCD_CLEAR:
         case LCD_HOME:
-            /* Return Home command: Sets DDRAM address 0 in address counter.
-             * Returns display from being shifted to original position. */
-            lcd_command(lcd, LCD_CMD_RETURN_HOME);
-            mdelay(2);
-            break;
-            
         case LCD_SET_CURSOR:
-            {
-                /* Decode the argument: High 8 bits = Row, Low 8 bits = Column.
-                 * 'arg' contains the integer value directly. */
-                int row = (arg >> 8) & 0xFF;
-                int col = arg & 0xFF;
-                
-                /* Standard DDRAM offsets for common LCD sizes (16x2, 20x4).
-                 * Row 0 starts at 0x00, Row 1 at 0x40, etc. */
-                int row_offsets[] = { 0x00, 0x40, 0x14, 0x54 };
-                
-                if (row >= 4) row = 0; // Wrap around if invalid row
-                
-                /* Send Set DDRAM Address command with calculated offset */
-                lcd_command(lcd, LCD_CMD_SET_DDRAM_ADDR | (col + row_offsets[row]));
-            }
-            break;
-            
         case LCD_BACKLIGHT:
-            /* Toggle the backlight bit in the internal state */
-            if (arg)
-                lcd->backlight_state = LCD_BL_BIT;
-            else
-                lcd->backlight_state = 0;
-            
-            /* Update the I2C expander immediately to reflect the change */
-            lcd_i2c_write_byte(lcd, lcd->backlight_state);
-            break;
-
         case LCD_DISPLAY_SWITCH:
-            /* Modify the Display ON/OFF bit in the control register */
-            if (arg)
-                lcd->display_ctrl |= LCD_DISPLAY_ON;
-            else
-                lcd->display_ctrl &= ~LCD_DISPLAY_ON;
-            
-            lcd_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
-            break;
-
         case LCD_CURSOR_SWITCH:
-            /* Modify the Cursor ON/OFF bit (underline) */
-            if (arg)
-                lcd->display_ctrl |= LCD_CURSOR_ON;
-            else
-                lcd->display_ctrl &= ~LCD_CURSOR_ON;
-                
-            lcd_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
-            break;
-
         case LCD_BLINK_SWITCH:
-            /* Modify the Blink ON/OFF bit (blinking block) */
-            if (arg)
-                lcd->display_ctrl |= LCD_BLINK_ON;
-            else
-                lcd->display_ctrl &= ~LCD_BLINK_ON;
-                
-            lcd_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
-            break;
-
         case LCD_SCROLL:
-            /* Shift the display window left or right.
-             * Note: This moves the viewport, not the data in RAM. */
-            if (arg == LCD_SCROLL_LEFT)
-                lcd_command(lcd, LCD_CMD_SHIFT | LCD_DISPLAY_MOVE | LCD_MOVE_LEFT);
-            else
-                lcd_command(lcd, LCD_CMD_SHIFT | LCD_DISPLAY_MOVE | LCD_MOVE_RIGHT);
-            break;
-
         case LCD_TEXT_DIR:
-            /* Set text entry mode: Left-to-Right or Right-to-Left */
-            if (arg == LCD_TEXT_LTR)
-                lcd->display_mode |= LCD_ENTRY_LEFT;
-            else
-                lcd->display_mode &= ~LCD_ENTRY_LEFT;
-                
-            lcd_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
-            break;
-
         case LCD_AUTOSCROLL:
-            /* Set text entry mode: Auto-shift (autoscroll) enable/disable */
-            if (arg)
-                lcd->display_mode |= LCD_ENTRY_SHIFT_INC;
-            else
-                lcd->display_mode &= ~LCD_ENTRY_SHIFT_INC;
-                
-            lcd_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
-            break;
-            
+            ret = lcd_submit_lock(lcd, nonblock);
+            if (ret)
+                return ret;
+            ret = lcd_queue_submit(lcd, cmd, arg, 0, nonblock);
+            mutex_unlock(&lcd->submit_lock);
+            return ret;
+
         default:
             /* Should be caught by the _IOC_NR check above, but good for safety */
             return -ENOTTY;
     }
-    return 0;
 }
 
 static const struct file_operations lcd_fops = {
@@ -478,8 +1202,249 @@ static const struct file_operations lcd_fops = {
     .release = lcd_release,
     .write = lcd_write,
     .unlocked_ioctl = lcd_ioctl,
+    .mmap = lcd_mmap,
+    .fsync = lcd_fsync,
+};
+
+/* ---------- sysfs statistics ---------- */
+
+/*
+ * /sys/class/aesdlcd_class/aesdlcdN/stats/ holds the bus, delay and queue
+ * counters, /sys/class/aesdlcd_class/aesdlcdN/commands/ the number of commands
+ * submitted per type, with text counted once per write() call. Writing anything to stats/reset zeroes all of them
+ * except the current queue depth.
+ */
+#define LCD_STAT_ATTR(_name)                                                   \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, \
+                            char *buf)                                         \
+{                                                                              \
+    struct lcd_dev *lcd = dev_get_drvdata(dev);                                \
+                                                                               \
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&lcd->stats._name));        \
+}                                                                              \
+static DEVICE_ATTR_RO(_name)
+
+LCD_STAT_ATTR(i2c_writes);
+LCD_STAT_ATTR(i2c_reads);
+LCD_STAT_ATTR(i2c_errors);
+LCD_STAT_ATTR(i2c_ns);
+LCD_STAT_ATTR(delay_ns);
+LCD_STAT_ATTR(text_bytes);
+LCD_STAT_ATTR(merged);
+LCD_STAT_ATTR(cleared);
+
+static ssize_t queue_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct lcd_dev *lcd = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(lcd->queued_cmds));
+}
+static DEVICE_ATTR_RO(queue_depth);
+
+static ssize_t queue_depth_max_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct lcd_dev *lcd = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(lcd->stats.queue_depth_max));
+}
+static DEVICE_ATTR_RO(queue_depth_max);
+
+static ssize_t queue_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct lcd_dev *lcd = dev_get_drvdata(dev);
+    unsigned int used;
+
+    spin_lock(&lcd->queue_lock);
+    used = lcd->text_head - lcd->text_tail;
+    spin_unlock(&lcd->queue_lock);
+    return sysfs_emit(buf, "%u\n", used);
+}
+static DEVICE_ATTR_RO(queue_bytes);
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+                           const char *buf, size_t count)
+{
+    struct lcd_dev *lcd = dev_get_drvdata(dev);
+    int i;
+
+    atomic64_set(&lcd->stats.i2c_writes, 0);
+    atomic64_set(&lcd->stats.i2c_reads, 0);
+    atomic64_set(&lcd->stats.i2c_errors, 0);
+    atomic64_set(&lcd->stats.i2c_ns, 0);
+    atomic64_set(&lcd->stats.delay_ns, 0);
+    atomic64_set(&lcd->stats.text_bytes, 0);
+    atomic64_set(&lcd->stats.merged, 0);
+    atomic64_set(&lcd->stats.cleared, 0);
+    for (i = 0; i < LCD_CMD_TYPES; i++)
+        atomic64_set(&lcd->stats.cmds[i], 0);
+
+    spin_lock(&lcd->queue_lock);
+    lcd->stats.queue_depth_max = lcd->queued_cmds;
+    spin_unlock(&lcd->queue_lock);
+    return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *lcd_stats_attrs[] = {
+    &dev_attr_i2c_writes.attr,
+    &dev_attr_i2c_reads.attr,
+    &dev_attr_i2c_errors.attr,
+    &dev_attr_i2c_ns.attr,
+    &dev_attr_delay_ns.attr,
+    &dev_attr_text_bytes.attr,
+    &dev_attr_merged.attr,
+    &dev_attr_cleared.attr,
+    &dev_attr_queue_depth.attr,
+    &dev_attr_queue_depth_max.attr,
+    &dev_attr_queue_bytes.attr,
+    &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group lcd_stats_group = {
+    .name = "stats",
+    .attrs = lcd_stats_attrs,
+};
+
+/*
+ * One read-only file per command type, all sharing lcd_cmd_count_show()
+ */
+struct lcd_cmd_attribute {
+    struct device_attribute attr;
+    unsigned int nr;
+};
+
+static ssize_t lcd_cmd_count_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct lcd_dev *lcd = dev_get_drvdata(dev);
+    struct lcd_cmd_attribute *ca = container_of(attr, struct lcd_cmd_attribute, attr);
+
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&lcd->stats.cmds[ca->nr]));
+}
+
+#define LCD_CMD_ATTR(_name, _op)                                      \
+static struct lcd_cmd_attribute lcd_cmd_attr_##_name = {              \
+    .attr = __ATTR(_name, 0444, lcd_cmd_count_show, NULL),            \
+    .nr = _IOC_NR(_op),                                               \
+}
+
+LCD_CMD_ATTR(write, LCD_OP_WRITE);
+LCD_CMD_ATTR(clear, LCD_CLEAR);
+LCD_CMD_ATTR(set_cursor, LCD_SET_CURSOR);
+LCD_CMD_ATTR(backlight, LCD_BACKLIGHT);
+LCD_CMD_ATTR(home, LCD_HOME);
+LCD_CMD_ATTR(display_switch, LCD_DISPLAY_SWITCH);
+LCD_CMD_ATTR(cursor_switch, LCD_CURSOR_SWITCH);
+LCD_CMD_ATTR(blink_switch, LCD_BLINK_SWITCH);
+LCD_CMD_ATTR(scroll, LCD_SCROLL);
+LCD_CMD_ATTR(text_dir, LCD_TEXT_DIR);
+LCD_CMD_ATTR(autoscroll, LCD_AUTOSCROLL);
+LCD_CMD_ATTR(fb_flush, LCD_FB_FLUSH);
+LCD_CMD_ATTR(marquee, LCD_MARQUEE);
+LCD_CMD_ATTR(load_glyph, LCD_LOAD_GLYPH);
+
+static struct attribute *lcd_cmd_attrs[] = {
+    &lcd_cmd_attr_write.attr.attr,
+    &lcd_cmd_attr_clear.attr.attr,
+    &lcd_cmd_attr_set_cursor.attr.attr,
+    &lcd_cmd_attr_backlight.attr.attr,
+    &lcd_cmd_attr_home.attr.attr,
+    &lcd_cmd_attr_display_switch.attr.attr,
+    &lcd_cmd_attr_cursor_switch.attr.attr,
+    &lcd_cmd_attr_blink_switch.attr.attr,
+    &lcd_cmd_attr_scroll.attr.attr,
+    &lcd_cmd_attr_text_dir.attr.attr,
+    &lcd_cmd_attr_autoscroll.attr.attr,
+    &lcd_cmd_attr_fb_flush.attr.attr,
+    &lcd_cmd_attr_marquee.attr.attr,
+    &lcd_cmd_attr_load_glyph.attr.attr,
+    NULL,
+};
+
+static const struct attribute_group lcd_cmd_group = {
+    .name = "commands",
+    .attrs = lcd_cmd_attrs,
+};
+
+static const struct attribute_group *lcd_groups[] = {
+    &lcd_stats_group,
+    &lcd_cmd_group,
+    NULL,
 };
 
+/**
+ * lcd_geometry() - Select the size of the character grid
+ * @lcd: Pointer to the local device structure
+ *
+ * The rows/cols module parameters take precedence over the device tree
+ * properties, which take precedence over the 16x2 default.
+ *
+ * Return: 0 on success, -EINVAL if the module does not support the size
+ */
+static int lcd_geometry(struct lcd_dev *lcd)
+{
+    struct device *dev = &lcd->client->dev;
+    u32 r = LCD_DEFAULT_ROWS, c = LCD_DEFAULT_COLS;
+
+    device_property_read_u32(dev, "display-height-chars", &r);
+    device_property_read_u32(dev, "display-width-chars", &c);
+    if (rows)
+        r = rows;
+    if (cols)
+        c = cols;
+
+    if (!lcd_hd44780_set_geometry(&lcd->hd, r, c)) {
+        dev_err(dev, "Unsupported geometry %ux%u\n", c, r);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * lcd_teardown() - Undo the probe of a display that may already be open
+ * @lcd: Pointer to the local device structure, with its cdev added
+ *
+ * Drops the reference of the I2C device. Files and mappings still open keep
+ * the structure alive, their operations fail with -ENODEV from here on.
+ */
+static void lcd_teardown(struct lcd_dev *lcd)
+{
+    /* 1. Delete the cdev and give the minor back for the next display
+     * void cdev_del(struct cdev *p);
+     * Removes the char device from the kernel system. Files already open
+     * keep working until they are closed, new opens no longer find the display. */
+    cdev_del(lcd->cdev);
+    mutex_lock(&lcd_minors_lock);
+    idr_remove(&lcd_minors, MINOR(lcd->dev_num));
+    mutex_unlock(&lcd_minors_lock);
+
+    /* 2. Cut off the open files. Once they see removed, which is set while
+     * nobody uses the bus, they neither touch the bus nor queue work again,
+     * and those waiting for the queue give up with -ENODEV. */
+    mutex_lock(&lcd->lock);
+    spin_lock(&lcd->queue_lock);
+    lcd->removed = true;
+    spin_unlock(&lcd->queue_lock);
+    mutex_unlock(&lcd->lock);
+    wake_up_interruptible_all(&lcd->queue_wait);
+
+    /* 3. Stop the queue consumer, then the marquee and the framebuffer refresh.
+     * The queue goes first since it can start the marquee, and the timer
+     * before its work since it would queue the work again. */
+    cancel_work_sync(&lcd->queue_work);
+    spin_lock(&lcd->queue_lock);
+    lcd_queue_free(lcd);
+    spin_unlock(&lcd->queue_lock);
+    hrtimer_cancel(&lcd->marquee_timer);
+    cancel_work_sync(&lcd->marquee_work);
+    cancel_delayed_work_sync(&lcd->refresh_work);
+    destroy_workqueue(lcd->wq);
+
+    /* 4. Drop the reference of the I2C device, the memory goes with the last
+     * open file or mapping */
+    kref_put(&lcd->ref, lcd_free);
+}
+
 /**
  * lcd_probe() - Initialize the device when the I2C client is detected
  * @client: The I2C client structure provided by the kernel
@@ -491,6 +1456,8 @@ static int lcd_probe(struct i2c_client *client)
 {
     int ret;
     struct lcd_dev *lcd;
+    struct device *dev;
+    int i;
     
     /* 0. Allocate memory for device state */
     lcd = kzalloc(sizeof(struct lcd_dev), GFP_KERNEL);
@@ -498,73 +1465,136 @@ static int lcd_probe(struct i2c_client *client)
         return -ENOMEM;
         
     lcd->client = client;
-    lcd->backlight_state = LCD_BL_BIT; /* Default On */
+    kref_init(&lcd->ref);
+    lcd_hd44780_setup(&lcd->hd, &lcd_i2c_ops, lcd);
+    mutex_init(&lcd->lock);
+    atomic_set(&lcd->fb_maps, 0);
+    INIT_DELAYED_WORK(&lcd->refresh_work, lcd_refresh_work);
+    INIT_WORK(&lcd->marquee_work, lcd_marquee_work);
+    INIT_LIST_HEAD(&lcd->queue);
+    spin_lock_init(&lcd->queue_lock);
+    INIT_WORK(&lcd->queue_work, lcd_queue_work);
+    init_waitqueue_head(&lcd->queue_wait);
+    mutex_init(&lcd->submit_lock);
+    INIT_LIST_HEAD(&lcd->cmd_free);
+    for (i = 0; i < LCD_QUEUE_CMDS; i++)
+        list_add_tail(&lcd->cmd_pool[i].list, &lcd->cmd_free);
+    atomic_set(&lcd->marquee_steps, 0);
+    hrtimer_init(&lcd->marquee_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    lcd->marquee_timer.function = lcd_marquee_timer_fn;
     i2c_set_clientdata(client, lcd);
+
+    ret = lcd_geometry(lcd);
+    if (ret)
+        goto err_put;
+
+    /* The framebuffer gets a whole page since that is the unit mmap() works in */
+    lcd->fb = (char *)get_zeroed_page(GFP_KERNEL);
+    if (!lcd->fb) {
+        ret = -ENOMEM;
+        goto err_put;
+    }
+
+    /* Staging ring for the text of queued writes, so write() never allocates */
+    lcd->text = kmalloc(LCD_TEXT_RING_SIZE, GFP_KERNEL);
+    if (!lcd->text) {
+        ret = -ENOMEM;
+        goto err_put;
+    }
     
     /* Initialize LCD hardware */
-    lcd_init_sequence(lcd);
+    lcd_hd44780_init_sequence(&lcd->hd);
+    memset(lcd->fb, ' ', PAGE_SIZE);
+
+    /* The init sequence always runs on fixed delays, busy flag mode can only
+     * be turned on once the controller is in 4-bit mode */
+    if (busy_poll) {
+        lcd->hd.busy_poll = lcd_hd44780_busy_flag_wired(&lcd->hd);
+        if (!lcd->hd.busy_poll)
+            dev_warn(&client->dev, "Busy flag not readable, using fixed delays\n");
+    }
     
-    /* 1. Allocate a range of device numbers
-     * int alloc_chrdev_region(dev_t *dev, unsigned baseminor, unsigned count, const char *name);
-     * @param dev: Pointer to dev_t variable to store the first allocated device number
-     * @param baseminor: First minor number to allocate (0 in our case)
-     * @param count: Number of contiguous minor numbers to allocate (1 in our case)
-     * @param name: Name of the device as it will appear in /proc/devices */
-    ret = alloc_chrdev_region(&lcd->dev_num, 0, 1, DRIVER_NAME);
+    /* 1. Take a free minor from the range reserved at module load
+     * int idr_alloc(struct idr *idr, void *ptr, int start, int end, gfp_t gfp);
+     * Returns the lowest unused id below end, so /dev/aesdlcdN numbers are
+     * reused after a display goes away, and maps it to this display for open(). */
+    mutex_lock(&lcd_minors_lock);
+    ret = idr_alloc(&lcd_minors, lcd, 0, LCD_MAX_DEVICES, GFP_KERNEL);
+    mutex_unlock(&lcd_minors_lock);
     if (ret < 0) {
-        dev_err(&client->dev, "Failed to allocate chrdev region\n");
-        goto err_free;
+        dev_err(&client->dev, "No free minor, at most %d displays\n", LCD_MAX_DEVICES);
+        goto err_put;
     }
+    lcd->dev_num = MKDEV(MAJOR(lcd_devt), ret);
     
-    /* 2. Create the device class
-     * struct class *class_create(const char *name);
-     * @param name: The name of the class (appears in /sys/class/)
-     * This creates the high-level class under which our device will appear. */
-    lcd->class = class_create(LCD_CLASS_NAME);
-    if (IS_ERR(lcd->class)) {
-        dev_err(&client->dev, "Failed to create class\n");
-        ret = PTR_ERR(lcd->class);
-        goto err_unregister;
+    /* 2. Create the workqueue of this display
+     * Unbound workers are not tied to the CPU that queued the work, so the
+     * busy-waits of one display cannot delay the work of another one, and
+     * high priority keeps the marquee steps on time. */
+    lcd->wq = alloc_workqueue("aesdlcd%d", WQ_UNBOUND | WQ_HIGHPRI, 0, MINOR(lcd->dev_num));
+    if (!lcd->wq) {
+        ret = -ENOMEM;
+        goto err_free_minor;
     }
     
-    /* 3. Initialize the character device structure (cdev)
-     * void cdev_init(struct cdev *cdev, const struct file_operations *fops);
-     * @param cdev: The cdev structure to initialize
-     * @param fops: The file_operations structure defining our read/write/ioctl callbacks */
-    cdev_init(&lcd->cdev, &lcd_fops);
+    /* 3. Allocate the character device structure (cdev)
+     * struct cdev *cdev_alloc(void);
+     * The VFS drops its reference to the cdev only after the release() of
+     * the last file, which may free the display, so the cdev cannot be
+     * embedded in it. ops holds our read/write/ioctl callbacks. */
+    lcd->cdev = cdev_alloc();
+    if (!lcd->cdev) {
+        ret = -ENOMEM;
+        goto err_destroy_wq;
+    }
+    lcd->cdev->owner = THIS_MODULE;
+    lcd->cdev->ops = &lcd_fops;
 
     /* 4. Add the character device to the system
      * int cdev_add(struct cdev *p, dev_t dev, unsigned count);
      * @param p: The initialized cdev structure
      * @param dev: The device number (major+minor)
      * @param count: Number of devices
-     * After this call, the kernel knows to route /dev/aesdlcd operations to our functions. */
-    ret = cdev_add(&lcd->cdev, lcd->dev_num, 1);
+     * After this call, the kernel knows to route /dev/aesdlcdN operations to our functions. */
+    ret = cdev_add(lcd->cdev, lcd->dev_num, 1);
     if (ret < 0) {
         dev_err(&client->dev, "Failed to add cdev\n");
-        goto err_destroy_class;
+        kobject_put(&lcd->cdev->kobj);
+        goto err_destroy_wq;
     }
     
     /* 5. Create the device node
-     * struct device *device_create(struct class *class, struct device *parent, 
-     * dev_t devt, void *drvdata, const char *fmt, ...);
+     * struct device *device_create_with_groups(struct class *class, struct device *parent,
+     * dev_t devt, void *drvdata, const struct attribute_group **groups, const char *fmt, ...);
      * @param class: The class the device belongs to
      * @param parent: The parent device (client->dev) for sysfs hierarchy
      * @param devt: The device number
-     * @param drvdata: Driver private data (NULL here)
-     * @param fmt: The name of the device node (appears in /dev/aesdlcd)
-     * This triggers udev to create the actual /dev/aesdlcd file. */
-    device_create(lcd->class, &client->dev, lcd->dev_num, NULL, "aesdlcd");
+     * @param drvdata: Driver private data, read back by the sysfs attributes
+     * @param groups: The stats/ and commands/ attribute directories
+     * @param fmt: The name of the device node (appears in /dev/aesdlcdN)
+     * This triggers udev to create the actual /dev/aesdlcdN file. The attributes
+     * are created before the uevent, so udev rules can already see them. */
+    dev = device_create_with_groups(lcd_class, &client->dev, lcd->dev_num, lcd,
+                                    lcd_groups, "aesdlcd%d", MINOR(lcd->dev_num));
+    if (IS_ERR(dev)) {
+        dev_err(&client->dev, "Failed to create device\n");
+        ret = PTR_ERR(dev);
+        lcd_teardown(lcd);
+        return ret;
+    }
     
-    dev_info(&client->dev, "AESD LCD driver probed at addr 0x%x\n", client->addr);
+    dev_info(&client->dev, "AESD LCD driver probed at addr 0x%x as aesdlcd%d, %ux%u\n",
+             client->addr, MINOR(lcd->dev_num), lcd->hd.cols, lcd->hd.rows);
     return 0;
 
-err_destroy_class:
-    class_destroy(lcd->class);
-err_unregister:
-    unregister_chrdev_region(lcd->dev_num, 1);
-err_free:
-    kfree(lcd);
+err_destroy_wq:
+    destroy_workqueue(lcd->wq);
+err_free_minor:
+    mutex_lock(&lcd_minors_lock);
+    idr_remove(&lcd_minors, MINOR(lcd->dev_num));
+    mutex_unlock(&lcd_minors_lock);
+err_put:
+    kref_put(&lcd->ref, lcd_free);
     return ret;
 }
 
@@ -574,52 +1604,38 @@ static void lcd_remove(struct i2c_client *client)
     
     /* 1. Destroy the device node 
      * void device_destroy(struct class *class, dev_t devt);
-     * Removes /dev/aesdlcd */
-    device_destroy(lcd->class, lcd->dev_num);
-
-    /* 2. Delete the cdev
-     * void cdev_del(struct cdev *p);
-     * Removes the char device from the kernel system */
-    cdev_del(&lcd->cdev);
-
-    /* 3. Destroy the class
-     * void class_destroy(struct class *cls);
-     * Cleans up /sys/class entries */
-    class_destroy(lcd->class);
+     * Removes /dev/aesdlcdN */
+    device_destroy(lcd_class, lcd->dev_num);
 
-    /* 4. Unregister the device numbers
-     * void unregister_chrdev_region(dev_t from, unsigned count);
-     * Returns the major/minor numbers to the kernel pool */
-    unregister_chrdev_region(lcd->dev_num, 1);
-
-    /* 5. Free memory */
-    kfree(lcd);
+    /* 2. Take the display away from open files and free it with the last one */
+    lcd_teardown(lcd);
 }
 
 /*
  * I2C Driver Registration & Startup Sequence
  * ----------------------------------------
  * * 1. DRIVER LOAD (insmod/modprobe): 
- * The kernel runs `module_i2c_driver()`. This registers `lcd_driver` with the 
- * I2C core, but DOES NOT create the character device yet.
+ * The kernel runs `lcd_init()`. This reserves a Dynamic Major Number with
+ * LCD_MAX_DEVICES minors via `alloc_chrdev_region()`, which registers
+ * "aesdlcd_driver" in /proc/devices, creates the sysfs class shared by all
+ * displays, and registers `lcd_driver` with the I2C core. No character
+ * device exists yet.
  * * 2. MATCHING: 
  * The I2C core checks the Device Tree (DTS). If it finds a node compatible 
  * with "freenove,lcd" or "hitachi,hd44780", it triggers the probe.
  * * 3. PROBE (lcd_probe):
- * The kernel calls `lcd_probe()`. This function:
- * a. Allocates a Dynamic Major Number via `alloc_chrdev_region()`. 
- * -> This registers "aesdlcd_driver" in /proc/devices.
- * b. Creates the sysfs class.
- * c. Calls `device_create()`.
- * -> This triggers the kernel to request udev to create /dev/aesdlcd 
+ * The kernel calls `lcd_probe()` once per matching node. This function:
+ * a. Takes the lowest free minor N.
+ * b. Creates the workqueue of that display.
+ * c. Calls `device_create_with_groups()`.
+ * -> This triggers the kernel to request udev to create /dev/aesdlcdN
  * (usually with root:root 600 permissions).
  * * 4.LOAD SCRIPT (load_aesdlcd.sh):
  * Our shell script runs after insmod. It:
- * a. Greps /proc/devices for "aesdlcd_driver" to find the Major Number 
- * allocated in Step 3a.
- * b. Deletes the /dev/aesdlcd node (potentially created by udev in Step 3c).
- * c. Manually runs `mknod` to recreate the device with '666' permissions,
- * allowing non-root users to write to the display.
+ * a. Reads the major:minor of every display from /sys/class/aesdlcd_class/.
+ * b. Deletes the /dev/aesdlcdN nodes (potentially created by udev in Step 3c).
+ * c. Manually runs `mknod` to recreate them with '666' permissions,
+ * allowing non-root users to write to the displays.
  */
 static const struct i2c_device_id lcd_id[] = {
     { "lcd_i2c", 0 },
@@ -663,5 +1679,46 @@ static struct i2c_driver lcd_driver = {
     .id_table = lcd_id,
 };
 
-/* Macro that registers the I2C driver with the kernel */
-module_i2c_driver(lcd_driver);
\ No newline at end of file
+/*
+ * Reserve the device numbers and the class for all displays, then register
+ * the I2C driver, which probes each of them
+ */
+static int __init lcd_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&lcd_devt, 0, LCD_MAX_DEVICES, DRIVER_NAME);
+    if (ret < 0) {
+        pr_err("%s: Failed to allocate chrdev region\n", DRIVER_NAME);
+        return ret;
+    }
+
+    lcd_class = class_create(LCD_CLASS_NAME);
+    if (IS_ERR(lcd_class)) {
+        pr_err("%s: Failed to create class\n", DRIVER_NAME);
+        ret = PTR_ERR(lcd_class);
+        goto err_unregister;
+    }
+
+    ret = i2c_add_driver(&lcd_driver);
+    if (ret)
+        goto err_destroy_class;
+    return 0;
+
+err_destroy_class:
+    class_destroy(lcd_class);
+err_unregister:
+    unregister_chrdev_region(lcd_devt, LCD_MAX_DEVICES);
+    return ret;
+}
+
+static void __exit lcd_exit(void)
+{
+    i2c_del_driver(&lcd_driver);
+    class_destroy(lcd_class);
+    unregister_chrdev_region(lcd_devt, LCD_MAX_DEVICES);
+    idr_destroy(&lcd_minors);
+}
+
+module_init(lcd_init);
+module_exit(lcd_exit);
\ No newline at end of file
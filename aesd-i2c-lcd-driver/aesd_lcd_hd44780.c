@@ -0,0 +1,790 @@
+/**
+ * @file aesd_lcd_hd44780.c
+ * @brief HD44780 protocol layer of the AESD I2C LCD driver
+ *
+ * Generates the PCF8574 byte stream for every display operation and keeps the
+ * driver's model of the controller state. Builds both in the kernel module and
+ * in user space (see emulator/), where the transport callbacks are backed by
+ * an emulated PCF8574 + HD44780.
+ *
+ * @author Scott Karl
+ *
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#include "aesd_lcd_hd44780.h"
+
+/*
+ * HD44780 LCD CONTROL VIA I2C
+ * =========================================================================
+ *
+ * 1. I2C "BACKPACK" DATA BYTE MAPPING
+ * -------------------------------------------------------------------------
+ * The PCF8574 IO expander connects the 8-bit I2C byte to the LCD pins.
+ * In 4-bit mode, only the upper nibble (D4-D7) is used for data.
+ *
+ * Bit 7 | Bit 6 | Bit 5 | Bit 4 | Bit 3 | Bit 2 | Bit 1 | Bit 0
+ * ------+-------+-------+-------+-------+-------+-------+------
+ *   D7  |   D6  |   D5  |   D4  |   BL  |   EN  |   RW  |   RS
+ *
+ * D7-D4 : LCD Data Bus (Sends High Nibble, then Low Nibble)
+ * BL    : Backlight (1 = On, 0 = Off)
+ * EN    : Enable (Pulse High->Low to latch data)
+ * RW    : Read/Write (0 = Write)
+ * RS    : Register Select (0 = Command, 1 = Data)
+ *
+ * 2. HD44780 INSTRUCTION SET FORMAT (Sent with RS=0)
+ * -------------------------------------------------------------------------
+ * Instruction               | D7  D6  D5  D4  D3  D2  D1  D0
+ * --------------------------+-------------------------------
+ * Clear Display             |  0   0   0   0   0   0   0   1
+ * Return Home               |  0   0   0   0   0   0   1   -
+ * Entry Mode Set            |  0   0   0   0   0   1  I/D  S
+ * Display On/Off            |  0   0   0   0   1   D   C   B
+ * Cursor/Display Shift      |  0   0   0   1  S/C R/L  -   -
+ * Function Set              |  0   0   1   DL  N   F   -   -
+ * Set CGRAM Address         |  0   1  ACG ACG ACG ACG ACG ACG
+ * Set DDRAM Address         |  1  ADD ADD ADD ADD ADD ADD ADD
+ *
+ * Legend:
+ * I/D=Inc/Dec, S=Shift, D=Disp On, C=Curs On, B=Blink,
+ * DL=DataLen (0=4bit), N=Lines, F=Font, ACG=CGRAM, ADD=DDRAM
+ *
+ * 3. EXAMPLE 1: Sending Data (Letter 'A' -> 0x41)
+ * -------------------------------------------------------------------------
+ * Character 'A' binary: 0100 0001
+ * Context: RS=1 (Data), RW=0 (Write), BL=1 (Backlight On)
+ *
+ * -- PASS 1: High Nibble (0100) --
+ * 1. Setup: D7..4=0100, EN=1, RS=1. Byte: 0100 1101 (0x4D) -> Prepare Latch
+ * 2. Latch: D7..4=0100, EN=0, RS=1. Byte: 0100 1001 (0x49) -> Execute
+ *
+ * -- PASS 2: Low Nibble (0001) --
+ * 3. Setup: D7..4=0001, EN=1, RS=1. Byte: 0001 1101 (0x1D) -> Prepare Latch
+ * 4. Latch: D7..4=0001, EN=0, RS=1. Byte: 0001 1001 (0x19) -> Execute
+ *
+ * I2C Stream: 0x4D, 0x49, 0x1D, 0x19
+ *
+ * 4. EXAMPLE 2: Sending Command (Clear Display -> 0x01)
+ * -------------------------------------------------------------------------
+ * Instruction Code: 0000 0001
+ * Context: RS=0 (Command), RW=0 (Write), BL=1 (Backlight On)
+ * IMPORTANT: "Clear Display" is slow! Must wait >1.52ms after sending.
+ *
+ * -- PASS 1: High Nibble (0000) --
+ * 1. Setup: D7..4=0000, EN=1, RS=0. Byte: 0000 1100 (0x0C) -> Prepare Latch
+ * 2. Latch: D7..4=0000, EN=0, RS=0. Byte: 0000 1000 (0x08) -> Execute
+ *
+ * -- PASS 2: Low Nibble (0001) --
+ * 3. Setup: D7..4=0001, EN=1, RS=0. Byte: 0001 1100 (0x1C) -> Prepare Latch
+ * 4. Latch: D7..4=0001, EN=0, RS=0. Byte: 0001 1000 (0x18) -> Execute
+ *
+ * I2C Stream: 0x0C, 0x08, 0x1C, 0x18 -> then Sleep(2)
+ *
+ * 5. READING THE BUSY FLAG (busy_poll=1)
+ * -------------------------------------------------------------------------
+ * Instead of sleeping for the worst case execution time, the controller can
+ * be asked whether it is done. With RW=1 the HD44780 drives D7..D4 and the
+ * PCF8574 reads them back, provided its data pins are first set high (the
+ * expander's quasi-bidirectional pins can only be read while driven high).
+ * A 4-bit read takes two Enable pulses: the first returns BF + AC6..AC4,
+ * the second AC3..AC0, which must be clocked out even though it is unused.
+ *
+ * 1. Setup: D7..4=1111, RW=1, EN=0. Byte: 1111 1010 (0xFA)
+ * 2. Pulse: D7..4=1111, RW=1, EN=1. Byte: 1111 1110 (0xFE) -> Read byte, BF = bit 7
+ * 3. Hold:  Byte 0xFA, then pulse 0xFE/0xFA again for the low nibble
+ *
+ * Every instruction and data write records when it is guaranteed to be done.
+ * The driver only polls while Clear Display or Return Home may still be
+ * running. A normal instruction usually finishes while the next nibble's
+ * setup and Enable transactions are still on the bus; if the bus is faster
+ * than that, the rest of its execution time is waited out right before the
+ * Enable falling edge that latches the next instruction.
+ */
+
+
+/*
+ * Write a byte to the I2C device
+ */
+static void lcd_i2c_write_byte(struct lcd_hd44780 *lcd, uint8_t data)
+{
+    lcd->ops->write_byte(lcd->priv, data);
+}
+
+/*
+ * Wait out the rest of the execution time of the last instruction, if any.
+ * Used in busy flag mode for the short remainders that are not worth polling.
+ */
+static void lcd_wait_exec(struct lcd_hd44780 *lcd)
+{
+    uint64_t now = lcd->ops->now_ns(lcd->priv);
+
+    if (now < lcd->busy_until_ns)
+        lcd->ops->delay_us(lcd->priv, (lcd->busy_until_ns - now + 999) / 1000);
+}
+
+/*
+ * Pulse the Enable bit to latch data
+ */
+static void lcd_pulse_enable(struct lcd_hd44780 *lcd, uint8_t data)
+{
+    lcd_i2c_write_byte(lcd, data | LCD_EN_BIT);
+    lcd->ops->delay_us(lcd->priv, 1);
+
+    /* In busy flag mode the controller must be done with the last instruction
+     * by the falling edge; otherwise the fixed delay below guarantees that */
+    if (lcd->busy_poll)
+        lcd_wait_exec(lcd);
+    lcd_i2c_write_byte(lcd, data & ~LCD_EN_BIT);
+
+    if (!lcd->busy_poll)
+        lcd->ops->delay_us(lcd->priv, LCD_EXEC_US);
+}
+
+/*
+ * Read the busy flag and the upper address counter bits.
+ * Returns the byte read during the first Enable pulse (BF in bit 7,
+ * AC6..AC4 in bits 6..4), or a negative error code from the transport.
+ */
+static int lcd_read_status(struct lcd_hd44780 *lcd)
+{
+    uint8_t data = LCD_D7_BIT | LCD_D6_BIT | LCD_D5_BIT | LCD_D4_BIT |
+                   LCD_RW_BIT | lcd->backlight_state;
+    int status;
+
+    lcd_i2c_write_byte(lcd, data);
+    lcd_i2c_write_byte(lcd, data | LCD_EN_BIT);
+    status = lcd->ops->read_byte(lcd->priv);
+    lcd_i2c_write_byte(lcd, data);
+
+    /* Clock out the low nibble to complete the 4-bit read cycle */
+    lcd_i2c_write_byte(lcd, data | LCD_EN_BIT);
+    lcd_i2c_write_byte(lcd, data);
+
+    return status;
+}
+
+/*
+ * Wait until the controller can accept the next instruction.
+ *
+ * Polls only while a slow command may still be executing. What is left of a
+ * normal instruction (37us) is usually covered by the setup and Enable
+ * transactions of the next nibble, and lcd_pulse_enable() waits out the rest
+ * if it is not. If the flag cannot be read or never clears, busy flag mode is
+ * switched off for good and the remaining worst case time is waited out
+ * instead.
+ */
+static void lcd_wait_ready(struct lcd_hd44780 *lcd)
+{
+    uint64_t start;
+    int status;
+
+    if (!lcd->busy_poll ||
+        lcd->ops->now_ns(lcd->priv) + LCD_EXEC_US * 1000ull >= lcd->busy_until_ns)
+        return;
+
+    start = lcd->ops->now_ns(lcd->priv);
+    do {
+        status = lcd_read_status(lcd);
+        if (status < 0)
+            break;
+        if (!(status & LCD_D7_BIT)) {
+            lcd->busy_until_ns = 0;
+            return;
+        }
+    } while (lcd->ops->now_ns(lcd->priv) - start < LCD_BUSY_TIMEOUT_US * 1000ull);
+
+    lcd->busy_poll = false;
+    lcd->ops->delay_us(lcd->priv, LCD_SLOW_EXEC_US);
+}
+
+/*
+ * Send a nibble (4 bits) to the LCD.
+ * 
+ * The HD44780 datasheet states that in 4-bit mode, data is sent to the 
+ * top 4 pins of the data bus (pins 4 through 7).
+ * 
+ * @nibble: The byte containing the data in the upper 4 bits (MSB).
+ *          The lower 4 bits are masked out.
+ * @rs:     Register Select (0=Command, 1=Data).
+ * 
+ * NOTE:
+ * The kernel function i2c_smbus_write_byte() executes a COMPLETE I2C transaction
+ * for every call: [START] [ADDR] [DATA] [STOP].
+ * * To latch a single 4-bit nibble into the LCD, this driver performs THREE 
+ * separate I2C writes. Crucially, the data nibble (bits 4-7) is sent 
+ * IDENTICALLY three times to ensure the data pins are stable while the 
+ * Enable pin (bit 2) is toggled:
+ * 1. Setup: [Nibble | EN=0] -> Stabilizes D4-D7 pins (Nibble sent 1st time)
+ * 2. Pulse: [Nibble | EN=1] -> Latch data           (Nibble sent 2nd time)
+ * 3. Hold:  [Nibble | EN=0] -> Complete pulse       (Nibble sent 3rd time)
+ */
+static void lcd_send_nibble(struct lcd_hd44780 *lcd, uint8_t nibble, uint8_t rs)
+{
+    uint8_t data = (nibble & 0xF0) | rs | lcd->backlight_state;
+    lcd_i2c_write_byte(lcd, data);
+    lcd_pulse_enable(lcd, data);
+}
+
+/*
+ * Send a full byte to the LCD (split into two nibbles).
+ * The controller executes it on the second falling edge of Enable; in busy
+ * flag mode that is when its execution time starts counting.
+ */
+static void lcd_send_byte(struct lcd_hd44780 *lcd, uint8_t byte, uint8_t rs)
+{
+    uint8_t high_nibble = byte & 0xF0;
+    uint8_t low_nibble = (byte << 4) & 0xF0;
+    
+    lcd_wait_ready(lcd);
+    lcd_send_nibble(lcd, high_nibble, rs);
+    lcd_send_nibble(lcd, low_nibble, rs);
+
+    if (lcd->busy_poll)
+        lcd->busy_until_ns = lcd->ops->now_ns(lcd->priv) + LCD_EXEC_US * 1000ull;
+}
+
+/*
+ * Send a command to the LCD
+ */
+void lcd_hd44780_command(struct lcd_hd44780 *lcd, uint8_t cmd)
+{
+    lcd_send_byte(lcd, cmd, 0);
+}
+
+/*
+ * Send one of the slow commands (Clear Display, Return Home).
+ * These require > 1.52ms execution time according to the datasheet. In busy
+ * flag mode the wait is left to the next transfer, which polls for it.
+ */
+static void lcd_slow_command(struct lcd_hd44780 *lcd, uint8_t cmd)
+{
+    lcd_hd44780_command(lcd, cmd);
+
+    if (lcd->busy_poll)
+        lcd->busy_until_ns = lcd->ops->now_ns(lcd->priv) + LCD_SLOW_EXEC_US * 1000ull;
+    else
+        lcd->ops->delay_us(lcd->priv, LCD_SLOW_EXEC_US);
+}
+
+/**
+ * lcd_hd44780_row_offset() - DDRAM address of the first column of a row
+ * @lcd: Controller state
+ * @row: Row number, must be below lcd->rows
+ *
+ * Even rows live in the first DDRAM line and odd rows in the second one.
+ * Rows 2/3 of 4-line modules continue those lines right after the visible
+ * columns of rows 0/1, which gives the familiar 0x00, 0x40, 0x14, 0x54 for
+ * 20x4 modules and 0x00, 0x40, 0x10, 0x50 for 16x4 ones.
+ *
+ * Return: The DDRAM address
+ */
+uint8_t lcd_hd44780_row_offset(const struct lcd_hd44780 *lcd, unsigned int row)
+{
+    return ((row & 1) ? LCD_DDRAM_LINE2 : 0x00) + (row >> 1) * lcd->cols;
+}
+
+/*
+ * Map a DDRAM address to its index in the rows x cols grid.
+ * Returns -1 if the address is not in the visible area.
+ */
+int lcd_hd44780_addr_to_cell(const struct lcd_hd44780 *lcd, uint8_t addr)
+{
+    int row;
+
+    for (row = 0; row < lcd->rows; row++) {
+        uint8_t offset = lcd_hd44780_row_offset(lcd, row);
+
+        if (addr >= offset && addr < offset + lcd->cols)
+            return row * lcd->cols + (addr - offset);
+    }
+    return -1;
+}
+
+/*
+ * Row the cursor is on, as far as newline and carriage return are concerned.
+ * Outside the visible area this is the row of the DDRAM line holding it.
+ */
+static unsigned int lcd_current_row(const struct lcd_hd44780 *lcd)
+{
+    int cell;
+
+    if (lcd->wrap_row >= 0)
+        return lcd->wrap_row;
+
+    cell = lcd_hd44780_addr_to_cell(lcd, lcd->addr);
+    if (cell >= 0)
+        return cell / lcd->cols;
+    return ((lcd->addr & LCD_DDRAM_LINE2) && lcd->rows > 1) ? 1 : 0;
+}
+
+/*
+ * Advance a DDRAM address the way the controller does after a data write,
+ * following the entry mode direction and wrapping between the two lines.
+ */
+static uint8_t lcd_next_addr(const struct lcd_hd44780 *lcd, uint8_t addr)
+{
+    if (lcd->display_mode & LCD_ENTRY_LEFT) {
+        if (addr == LCD_DDRAM_LINE_LEN - 1)
+            return LCD_DDRAM_LINE2;
+        if (addr == LCD_DDRAM_LINE2 + LCD_DDRAM_LINE_LEN - 1)
+            return 0x00;
+        return addr + 1;
+    }
+
+    if (addr == 0x00)
+        return LCD_DDRAM_LINE2 + LCD_DDRAM_LINE_LEN - 1;
+    if (addr == LCD_DDRAM_LINE2)
+        return LCD_DDRAM_LINE_LEN - 1;
+    return addr - 1;
+}
+
+/*
+ * Move the DDRAM address counter
+ */
+static void lcd_set_addr(struct lcd_hd44780 *lcd, uint8_t addr)
+{
+    lcd_hd44780_command(lcd, LCD_CMD_SET_DDRAM_ADDR | addr);
+    lcd->addr = addr;
+    lcd->wrap_row = -1;
+}
+
+/*
+ * Send data to the LCD.
+ * Keeps the tracked address counter and the shadow copy of the visible
+ * cells in step with what the controller now holds.
+ */
+static void lcd_data(struct lcd_hd44780 *lcd, uint8_t data)
+{
+    int cell;
+
+    lcd_send_byte(lcd, data, LCD_RS_BIT);
+
+    cell = lcd_hd44780_addr_to_cell(lcd, lcd->addr);
+    if (cell >= 0)
+        lcd->shadow[cell] = data;
+    lcd->addr = lcd_next_addr(lcd, lcd->addr);
+}
+
+/**
+ * lcd_hd44780_setup() - Prepare the controller state before first use
+ * @lcd: Controller state to initialize
+ * @ops: Transport callbacks
+ * @priv: Opaque pointer handed back to the callbacks
+ *
+ * Selects the default geometry and backlight on; lcd_hd44780_init_sequence()
+ * then brings the controller itself up.
+ */
+void lcd_hd44780_setup(struct lcd_hd44780 *lcd, const struct lcd_hd44780_ops *ops, void *priv)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    lcd->ops = ops;
+    lcd->priv = priv;
+    lcd->backlight_state = LCD_BL_BIT; /* Default On */
+    lcd->rows = LCD_DEFAULT_ROWS;
+    lcd->cols = LCD_DEFAULT_COLS;
+    lcd->wrap_row = -1;
+    memset(lcd->shadow, ' ', sizeof(lcd->shadow));
+}
+
+/**
+ * lcd_hd44780_set_geometry() - Select the size of the character grid
+ * @lcd: Controller state
+ * @rows: Number of visible rows, 1 to LCD_MAX_ROWS
+ * @cols: Number of visible columns, up to LCD_MAX_COLS, or half of that for
+ *        modules with more than 2 rows
+ *
+ * Must be called before lcd_hd44780_init_sequence().
+ *
+ * Return: true if the geometry is supported
+ */
+bool lcd_hd44780_set_geometry(struct lcd_hd44780 *lcd, unsigned int rows, unsigned int cols)
+{
+    if (rows < 1 || rows > LCD_MAX_ROWS || cols < 1 || cols > LCD_MAX_COLS)
+        return false;
+    if (rows > 2 && cols > LCD_DDRAM_LINE_LEN / 2)
+        return false;
+
+    lcd->rows = rows;
+    lcd->cols = cols;
+    return true;
+}
+
+/**
+ * lcd_hd44780_init_sequence() - Runs the HD44780 initialization logic
+ * @lcd: Controller state
+ *
+ * Implements the specific 4-bit initialization procedure required by the 
+ * controller datasheet. Sets default state (Display On, Cursor Off, etc.).
+ * Always runs on fixed delays; busy flag mode can only be enabled afterwards.
+ */
+void lcd_hd44780_init_sequence(struct lcd_hd44780 *lcd)
+{
+    bool busy_poll = lcd->busy_poll;
+
+    lcd->busy_poll = false;
+
+    /* Wait for more than 40ms after VCC rises to 2.7V. */
+    lcd->ops->delay_us(lcd->priv, 50000);
+
+    /* Initialization sequence for 4-bit mode */
+    lcd_send_nibble(lcd, 0x30, 0);
+    lcd->ops->delay_us(lcd->priv, 5000);
+    
+    lcd_send_nibble(lcd, 0x30, 0);
+    lcd->ops->delay_us(lcd->priv, 5000);
+    
+    lcd_send_nibble(lcd, 0x30, 0);
+    lcd->ops->delay_us(lcd->priv, 150);
+    
+    /* Finally, set to 4-bit interface */
+    lcd_send_nibble(lcd, 0x20, 0); 
+
+    /* Function set: 4-bit, 2 line, 5x8 dots */
+    lcd_hd44780_command(lcd, LCD_CMD_FUNCTION_SET | LCD_4BIT_MODE | LCD_2LINE | LCD_5x8DOTS);
+    
+    /* Default: Display on, Cursor off, Blink off */
+    lcd->display_ctrl = LCD_DISPLAY_ON | LCD_CURSOR_OFF | LCD_BLINK_OFF;
+    lcd_hd44780_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
+    
+    /* Clear display */
+    lcd_hd44780_clear(lcd);
+    
+    /* Default Entry mode: Increment cursor, no shift */
+    lcd->display_mode = LCD_ENTRY_LEFT | LCD_ENTRY_SHIFT_DEC;
+    lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+    
+    /* Return home */
+    lcd_hd44780_home(lcd);
+
+    lcd->busy_poll = busy_poll;
+}
+
+/**
+ * lcd_hd44780_busy_flag_wired() - Check whether the busy flag can be read back
+ * @lcd: Controller state
+ *
+ * Called right after the init sequence, when nothing is executing and the
+ * address counter is 0, so D7..D4 must all read back low. When RW is not
+ * connected the LCD never drives the bus and the PCF8574 pins read back high.
+ * In that case it also sees RW=0, so the two read pulses were latched as the
+ * instruction 0xFF (Set DDRAM Address 0x7F) and the address must be restored,
+ * on fixed delays since nothing timed that instruction.
+ *
+ * Return: true if busy flag mode can be used
+ */
+bool lcd_hd44780_busy_flag_wired(struct lcd_hd44780 *lcd)
+{
+    int status = lcd_read_status(lcd);
+
+    if (status >= 0 && (status & 0xF0) == 0)
+        return true;
+
+    lcd->busy_poll = false;
+    lcd->ops->delay_us(lcd->priv, LCD_EXEC_US);
+    lcd_set_addr(lcd, lcd->addr);
+    return false;
+}
+
+/*
+ * Clear display command: writes space code 0x20 to all DDRAM addresses,
+ * sets the address counter back to 0 and the entry mode back to increment.
+ */
+void lcd_hd44780_clear(struct lcd_hd44780 *lcd)
+{
+    lcd_slow_command(lcd, LCD_CMD_CLEAR);
+    memset(lcd->shadow, ' ', sizeof(lcd->shadow));
+    lcd->display_mode |= LCD_ENTRY_LEFT;
+    lcd->addr = 0;
+    lcd->wrap_row = -1;
+}
+
+/*
+ * Return Home command: Sets DDRAM address 0 in address counter.
+ * Returns display from being shifted to original position.
+ */
+void lcd_hd44780_home(struct lcd_hd44780 *lcd)
+{
+    lcd_slow_command(lcd, LCD_CMD_RETURN_HOME);
+    lcd->addr = 0;
+    lcd->wrap_row = -1;
+}
+
+/*
+ * Move the cursor to a row/column of the grid
+ */
+void lcd_hd44780_set_cursor(struct lcd_hd44780 *lcd, unsigned int row, unsigned int col)
+{
+    if (row >= lcd->rows) row = 0; // Wrap around if invalid row
+
+    /* Send Set DDRAM Address command with calculated offset */
+    lcd_set_addr(lcd, (col + lcd_hd44780_row_offset(lcd, row)) & 0x7F);
+}
+
+/*
+ * Toggle the backlight bit and update the I2C expander immediately
+ */
+void lcd_hd44780_set_backlight(struct lcd_hd44780 *lcd, bool on)
+{
+    lcd->backlight_state = on ? LCD_BL_BIT : 0;
+    lcd_i2c_write_byte(lcd, lcd->backlight_state);
+}
+
+/*
+ * Set or clear one of the Display/Cursor/Blink bits
+ */
+void lcd_hd44780_set_display_ctrl(struct lcd_hd44780 *lcd, uint8_t flag, bool on)
+{
+    if (on)
+        lcd->display_ctrl |= flag;
+    else
+        lcd->display_ctrl &= ~flag;
+
+    lcd_hd44780_command(lcd, LCD_CMD_DISPLAY_CTRL | lcd->display_ctrl);
+}
+
+/*
+ * Set or clear one of the Entry Mode bits (text direction, autoscroll)
+ */
+void lcd_hd44780_set_entry_mode(struct lcd_hd44780 *lcd, uint8_t flag, bool on)
+{
+    if (on)
+        lcd->display_mode |= flag;
+    else
+        lcd->display_mode &= ~flag;
+
+    lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+}
+
+/**
+ * lcd_hd44780_write() - Send text at the current address
+ * @lcd: Controller state
+ * @buf: Characters to write
+ * @count: Number of characters in @buf
+ * @grid: If not NULL, rows x cols grid that visible characters are mirrored into
+ *
+ * '\n' moves to the start of the next row and '\r' to the start of the
+ * current one, wrapping from the last row back to the first. In the default
+ * left-to-right entry mode without autoscroll, text reaching the end of a row
+ * continues at the start of the next row instead of running into DDRAM that
+ * is not visible. The wrap happens when the next character arrives, so a full
+ * row followed by '\n' moves down one row, not two.
+ */
+void lcd_hd44780_write(struct lcd_hd44780 *lcd, const char *buf, size_t count, char *grid)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        unsigned int row;
+        int cell;
+
+        if (buf[i] == '\n' || buf[i] == '\r') {
+            row = lcd_current_row(lcd);
+            if (buf[i] == '\n')
+                row = (row + 1) % lcd->rows;
+            lcd_set_addr(lcd, lcd_hd44780_row_offset(lcd, row));
+            continue;
+        }
+
+        if (lcd->wrap_row >= 0)
+            lcd_set_addr(lcd, lcd_hd44780_row_offset(lcd, (lcd->wrap_row + 1) % lcd->rows));
+
+        cell = lcd_hd44780_addr_to_cell(lcd, lcd->addr);
+        if (grid && cell >= 0)
+            grid[cell] = buf[i];
+        lcd_data(lcd, buf[i]);
+
+        if (cell >= 0 && cell % lcd->cols == lcd->cols - 1 && lcd->display_mode == LCD_ENTRY_LEFT)
+            lcd->wrap_row = cell / lcd->cols;
+    }
+}
+
+/**
+ * lcd_hd44780_flush() - Rewrite the cells that differ from a wanted grid
+ * @lcd: Controller state
+ * @want_grid: rows x cols grid holding the wanted contents. Must not change
+ *             during the call; callers working from shared memory pass a snapshot.
+ *
+ * Compares @want_grid against the shadow of the display and rewrites only the
+ * changed cells. Changed cells separated by a single unchanged cell are merged
+ * into one run, since rewriting one character costs the same bus traffic as
+ * the Set DDRAM Address command needed to skip it. The entry mode is forced to
+ * left-to-right without shift for the duration of the flush, and the address
+ * counter and a pending row wrap are restored afterwards so that text writes
+ * and the cursor continue from where they left off.
+ *
+ * Return: true if anything was sent to the display
+ */
+bool lcd_hd44780_flush(struct lcd_hd44780 *lcd, const char *want_grid)
+{
+    uint8_t saved_addr = lcd->addr;
+    uint8_t saved_mode = lcd->display_mode;
+    int saved_wrap_row = lcd->wrap_row;
+    bool dirty = false;
+    int row, col, end;
+
+    for (row = 0; row < lcd->rows; row++) {
+        const char *want = &want_grid[row * lcd->cols];
+        const char *have = &lcd->shadow[row * lcd->cols];
+
+        col = 0;
+        while (col < lcd->cols) {
+            if (want[col] == have[col]) {
+                col++;
+                continue;
+            }
+
+            /* Extend the run over changed cells and single-cell gaps */
+            end = col + 1;
+            while (end < lcd->cols &&
+                   (want[end] != have[end] ||
+                    (end + 1 < lcd->cols && want[end + 1] != have[end + 1])))
+                end++;
+
+            if (!dirty && (lcd->display_mode != LCD_ENTRY_LEFT)) {
+                lcd->display_mode = LCD_ENTRY_LEFT;
+                lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+            }
+            dirty = true;
+
+            lcd_set_addr(lcd, lcd_hd44780_row_offset(lcd, row) + col);
+            for (; col < end; col++)
+                lcd_data(lcd, want[col]);
+        }
+    }
+
+    if (!dirty)
+        return false;
+
+    if (lcd->display_mode != saved_mode) {
+        lcd->display_mode = saved_mode;
+        lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+    }
+    lcd_set_addr(lcd, saved_addr);
+    lcd->wrap_row = saved_wrap_row;
+    return true;
+}
+
+/*
+ * Write a bitmap into one CGRAM slot and return to DDRAM addressing.
+ * CGRAM writes follow the entry mode direction too, so right-to-left mode is
+ * suspended for the upload. Display shift does not apply to CGRAM writes.
+ */
+static void lcd_upload_glyph(struct lcd_hd44780 *lcd, int slot, const uint8_t *bitmap)
+{
+    uint8_t saved_mode = lcd->display_mode;
+    int saved_wrap_row = lcd->wrap_row;
+    int row;
+
+    if (!(lcd->display_mode & LCD_ENTRY_LEFT)) {
+        lcd->display_mode |= LCD_ENTRY_LEFT;
+        lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+    }
+
+    lcd_hd44780_command(lcd, LCD_CMD_SET_CGRAM_ADDR | (slot * LCD_GLYPH_ROWS));
+    for (row = 0; row < LCD_GLYPH_ROWS; row++)
+        lcd_send_byte(lcd, bitmap[row] & 0x1F, LCD_RS_BIT);
+
+    if (lcd->display_mode != saved_mode) {
+        lcd->display_mode = saved_mode;
+        lcd_hd44780_command(lcd, LCD_CMD_ENTRY_MODE | lcd->display_mode);
+    }
+    lcd_set_addr(lcd, lcd->addr);
+    lcd->wrap_row = saved_wrap_row;
+}
+
+/*
+ * Whether CGRAM @slot is shown in any visible cell. Character codes 8 to 15
+ * show slots 0 to 7 again.
+ */
+static bool lcd_glyph_visible(const struct lcd_hd44780 *lcd, int slot)
+{
+    return memchr(lcd->shadow, slot, lcd->rows * lcd->cols) != NULL ||
+           memchr(lcd->shadow, slot | 8, lcd->rows * lcd->cols) != NULL;
+}
+
+/**
+ * lcd_hd44780_load_glyph() - Make a custom character available
+ * @lcd: Controller state
+ * @bitmap: LCD_GLYPH_ROWS rows from top to bottom, pixels in the low 5 bits
+ *
+ * The CGRAM slots are a cache keyed by the bitmap. A glyph that is already
+ * loaded costs no bus traffic. Otherwise it goes to a free slot, or replaces
+ * the least recently requested glyph, preferring one that is not on screen
+ * since every cell showing a replaced glyph changes along with it.
+ *
+ * Return: The slot, which is also the character code displaying the glyph
+ */
+int lcd_hd44780_load_glyph(struct lcd_hd44780 *lcd, const uint8_t *bitmap)
+{
+    struct lcd_hd44780_glyph *glyph;
+    uint64_t key = 0;
+    int slot, victim, unused = -1, lru = -1, hidden = -1;
+    int row;
+
+    for (row = 0; row < LCD_GLYPH_ROWS; row++)
+        key = (key << 5) | (bitmap[row] & 0x1F);
+    lcd->glyph_clock++;
+
+    for (slot = 0; slot < LCD_CGRAM_SLOTS; slot++) {
+        glyph = &lcd->glyphs[slot];
+        if (!glyph->loaded) {
+            if (unused < 0)
+                unused = slot;
+            continue;
+        }
+        if (glyph->key == key) {
+            glyph->last_used = lcd->glyph_clock;
+            return slot;
+        }
+        if (lru < 0 || glyph->last_used < lcd->glyphs[lru].last_used)
+            lru = slot;
+        if ((hidden < 0 || glyph->last_used < lcd->glyphs[hidden].last_used) &&
+            !lcd_glyph_visible(lcd, slot))
+            hidden = slot;
+    }
+
+    if (unused >= 0)
+        victim = unused;
+    else if (hidden >= 0)
+        victim = hidden;
+    else
+        victim = lru;
+
+    lcd_upload_glyph(lcd, victim, bitmap);
+    glyph = &lcd->glyphs[victim];
+    glyph->key = key;
+    glyph->last_used = lcd->glyph_clock;
+    glyph->loaded = true;
+    return victim;
+}
+
+/**
+ * lcd_hd44780_marquee_window() - Render one step of a scrolling message
+ * @text: The message
+ * @len: Length of @text, must not be 0
+ * @pos: Position in the cycle of @len + LCD_MARQUEE_GAP cells shown in the first column
+ * @row: Receives @cols characters
+ * @cols: Width of the row
+ *
+ * The message repeats endlessly, separated by LCD_MARQUEE_GAP blanks, and
+ * moves one cell to the left each time @pos is incremented. Feeding the row
+ * to lcd_hd44780_flush() only rewrites the cells that actually changed.
+ */
+void lcd_hd44780_marquee_window(const char *text, size_t len, size_t pos, char *row, unsigned int cols)
+{
+    size_t period = len + LCD_MARQUEE_GAP;
+    unsigned int col;
+
+    pos %= period;
+    for (col = 0; col < cols; col++) {
+        row[col] = pos < len ? text[pos] : ' ';
+        if (++pos == period)
+            pos = 0;
+    }
+}
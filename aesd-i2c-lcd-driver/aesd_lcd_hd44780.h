@@ -0,0 +1,199 @@
+/*
+ * aesd_lcd_hd44780.h
+ *
+ * HD44780 protocol layer of the AESD I2C LCD driver: turns display operations
+ * into the byte stream written to the PCF8574 backpack. It has no kernel
+ * dependencies beyond the transport callbacks, so the same code runs inside
+ * the driver and against the userspace emulator in emulator/.
+ *
+ *  Author: Scott Karl
+ */
+
+#ifndef AESD_LCD_HD44780_H
+#define AESD_LCD_HD44780_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#endif
+
+/* PCF8574 Pin Definitions */
+#define LCD_RS_BIT      (1 << 0)
+#define LCD_RW_BIT      (1 << 1)
+#define LCD_EN_BIT      (1 << 2)
+#define LCD_BL_BIT      (1 << 3)
+#define LCD_D4_BIT      (1 << 4)
+#define LCD_D5_BIT      (1 << 5)
+#define LCD_D6_BIT      (1 << 6)
+#define LCD_D7_BIT      (1 << 7)
+
+/* LCD Commands */
+#define LCD_CMD_CLEAR           0x01
+#define LCD_CMD_RETURN_HOME     0x02
+#define LCD_CMD_ENTRY_MODE      0x04
+#define LCD_CMD_DISPLAY_CTRL    0x08
+#define LCD_CMD_SHIFT           0x10
+#define LCD_CMD_FUNCTION_SET    0x20
+#define LCD_CMD_SET_CGRAM_ADDR  0x40
+#define LCD_CMD_SET_DDRAM_ADDR  0x80
+
+/* Flags for display entry mode */
+#define LCD_ENTRY_RIGHT         0x00
+#define LCD_ENTRY_LEFT          0x02
+#define LCD_ENTRY_SHIFT_INC     0x01
+#define LCD_ENTRY_SHIFT_DEC     0x00
+
+/* Flags for display on/off control */
+#define LCD_DISPLAY_ON          0x04
+#define LCD_DISPLAY_OFF         0x00
+#define LCD_CURSOR_ON           0x02
+#define LCD_CURSOR_OFF          0x00
+#define LCD_BLINK_ON            0x01
+#define LCD_BLINK_OFF           0x00
+
+/* Flags for display/cursor shift */
+#define LCD_DISPLAY_MOVE        0x08
+#define LCD_CURSOR_MOVE         0x00
+#define LCD_MOVE_RIGHT          0x04
+#define LCD_MOVE_LEFT           0x00
+
+/* Flags for function set */
+#define LCD_8BIT_MODE           0x10
+#define LCD_4BIT_MODE           0x00
+#define LCD_2LINE               0x08
+#define LCD_1LINE               0x00
+#define LCD_5x10DOTS            0x04
+#define LCD_5x8DOTS             0x00
+
+/* Instruction execution times used to decide when the controller may still be
+ * busy, and how long to poll the busy flag before giving up on it */
+#define LCD_EXEC_US             50
+#define LCD_SLOW_EXEC_US        2000
+#define LCD_BUSY_TIMEOUT_US     10000
+
+/* DDRAM layout in 2-line mode: each line is 40 (0x28) addresses long and the
+ * second line starts at 0x40. 4-line modules fold rows 3/4 onto the end of
+ * lines 1/2, right after the visible columns of rows 1/2, see
+ * lcd_hd44780_row_offset(). */
+#define LCD_DDRAM_LINE_LEN      0x28
+#define LCD_DDRAM_LINE2         0x40
+
+/* Geometry of the character grid. The defaults match the Freenove 1602 module.
+ * Modules with more than 2 rows can be at most half a DDRAM line wide. */
+#define LCD_MAX_ROWS            4
+#define LCD_MAX_COLS            LCD_DDRAM_LINE_LEN
+#define LCD_DEFAULT_ROWS        2
+#define LCD_DEFAULT_COLS        16
+
+/* CGRAM holds 8 custom characters of 8 rows of 5 pixels in the 5x8 font,
+ * displayed by writing character codes 0 to 7 */
+#define LCD_CGRAM_SLOTS         8
+#define LCD_GLYPH_ROWS          8
+
+/* Blank cells between the end of a marquee message and its next repetition */
+#define LCD_MARQUEE_GAP         4
+
+/**
+ * struct lcd_hd44780_ops - Transport to the PCF8574 backpack
+ * @write_byte: Perform one single-byte I2C write of the expander outputs
+ * @read_byte: Perform one single-byte I2C read of the expander pins,
+ *             returns the byte or a negative error code
+ * @delay_us: Wait for the given number of microseconds
+ * @now_ns: Monotonic time in nanoseconds
+ *
+ * Every callback receives the @priv pointer given to lcd_hd44780_setup().
+ */
+struct lcd_hd44780_ops {
+    void (*write_byte)(void *priv, uint8_t data);
+    int (*read_byte)(void *priv);
+    void (*delay_us)(void *priv, unsigned int us);
+    uint64_t (*now_ns)(void *priv);
+};
+
+/**
+ * struct lcd_hd44780_glyph - What one CGRAM slot holds
+ * @key: The 8 rows of 5 bits packed into 40 bits, identifies the bitmap
+ * @last_used: Value of the glyph clock when the slot was last requested
+ * @loaded: The slot holds a glyph uploaded by lcd_hd44780_load_glyph()
+ */
+struct lcd_hd44780_glyph {
+    uint64_t key;
+    uint32_t last_used;
+    bool loaded;
+};
+
+/**
+ * struct lcd_hd44780 - Controller state as tracked by the driver
+ * @ops: Transport callbacks
+ * @priv: Opaque pointer handed back to the callbacks
+ * @backlight_state: The state of the backlight (ON/OFF bit)
+ * @display_ctrl: The Display/Cursor/Blink command bits
+ * @display_mode: The Entry Mode (text direction/autoscroll) bits
+ * @rows: Number of visible character rows
+ * @cols: Number of visible character columns
+ * @addr: Tracked copy of the controller's DDRAM address counter
+ * @wrap_row: Row whose last column was just written by lcd_hd44780_write(),
+ *            the next character starts the following row. -1 if none.
+ * @shadow: The characters last written to each visible cell
+ * @busy_poll: Wait on the busy flag rather than on fixed delays
+ * @busy_until_ns: Time at which the last instruction is guaranteed to be done
+ * @glyphs: Contents of the CGRAM slots, managed as an LRU cache
+ * @glyph_clock: Counts glyph requests to order the slots by last use
+ *
+ * None of the functions below lock; callers serialize access to one display.
+ */
+struct lcd_hd44780 {
+    const struct lcd_hd44780_ops *ops;
+    void *priv;
+    uint8_t backlight_state;
+    uint8_t display_ctrl;
+    uint8_t display_mode;
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t addr;
+    int wrap_row;
+    char shadow[LCD_MAX_ROWS * LCD_MAX_COLS];
+    bool busy_poll;
+    uint64_t busy_until_ns;
+    struct lcd_hd44780_glyph glyphs[LCD_CGRAM_SLOTS];
+    uint32_t glyph_clock;
+};
+
+extern void lcd_hd44780_setup(struct lcd_hd44780 *lcd, const struct lcd_hd44780_ops *ops, void *priv);
+
+extern bool lcd_hd44780_set_geometry(struct lcd_hd44780 *lcd, unsigned int rows, unsigned int cols);
+
+extern uint8_t lcd_hd44780_row_offset(const struct lcd_hd44780 *lcd, unsigned int row);
+
+extern void lcd_hd44780_init_sequence(struct lcd_hd44780 *lcd);
+
+extern bool lcd_hd44780_busy_flag_wired(struct lcd_hd44780 *lcd);
+
+extern void lcd_hd44780_command(struct lcd_hd44780 *lcd, uint8_t cmd);
+
+extern void lcd_hd44780_clear(struct lcd_hd44780 *lcd);
+
+extern void lcd_hd44780_home(struct lcd_hd44780 *lcd);
+
+extern void lcd_hd44780_set_cursor(struct lcd_hd44780 *lcd, unsigned int row, unsigned int col);
+
+extern void lcd_hd44780_set_backlight(struct lcd_hd44780 *lcd, bool on);
+
+extern void lcd_hd44780_set_display_ctrl(struct lcd_hd44780 *lcd, uint8_t flag, bool on);
+
+extern void lcd_hd44780_set_entry_mode(struct lcd_hd44780 *lcd, uint8_t flag, bool on);
+
+extern int lcd_hd44780_addr_to_cell(const struct lcd_hd44780 *lcd, uint8_t addr);
+
+extern void lcd_hd44780_write(struct lcd_hd44780 *lcd, const char *buf, size_t count, char *grid);
+
+extern bool lcd_hd44780_flush(struct lcd_hd44780 *lcd, const char *want);
+
+extern int lcd_hd44780_load_glyph(struct lcd_hd44780 *lcd, const uint8_t *bitmap);
+
+extern void lcd_hd44780_marquee_window(const char *text, size_t len, size_t pos, char *row, unsigned int cols);
+
+#endif /* AESD_LCD_HD44780_H */
@@ -17,6 +17,10 @@
 #define LCD_SCROLL          _IOW(LCD_IOC_MAGIC, 8, int)  /* 0 for left, 1 for right */
 #define LCD_TEXT_DIR        _IOW(LCD_IOC_MAGIC, 9, int)  /* 0 for Right-to-Left, 1 for Left-to-Right */
 #define LCD_AUTOSCROLL      _IOW(LCD_IOC_MAGIC, 10, int) /* 1 for on, 0 for off */
+#define LCD_FB_FLUSH        _IO(LCD_IOC_MAGIC, 11)       /* Push pending changes in the mmap() grid now */
+#define LCD_GET_GEOMETRY    _IOR(LCD_IOC_MAGIC, 12, int) /* Returns (rows << 8 | cols) through the int pointer */
+#define LCD_MARQUEE         _IOW(LCD_IOC_MAGIC, 13, struct lcd_marquee) /* Start/stop a scrolling message */
+#define LCD_LOAD_GLYPH      _IOWR(LCD_IOC_MAGIC, 14, struct lcd_glyph)  /* Get a character code for a custom glyph */
 
 /* Scroll direction constants */
 #define LCD_SCROLL_LEFT     0
@@ -26,4 +30,51 @@
 #define LCD_TEXT_RTL        0
 #define LCD_TEXT_LTR        1
 
-#endif
\ No newline at end of file
+/*
+ * Character framebuffer
+ * mmap() of /dev/aesdlcdN (offset 0, up to one page) exposes the display as a
+ * row-major grid of rows x cols bytes, one character code per cell, with a row
+ * stride of cols. Stores into the grid are pushed to the display by the driver
+ * at the refresh interval set by the fb_refresh_ms module parameter, and
+ * immediately on LCD_FB_FLUSH or msync(MS_SYNC)/fsync().
+ * Use LCD_GET_GEOMETRY to find the grid dimensions.
+ */
+#define LCD_GEOMETRY_ROWS(g) (((g) >> 8) & 0xFF)
+#define LCD_GEOMETRY_COLS(g) ((g) & 0xFF)
+
+/*
+ * Marquee
+ * LCD_MARQUEE scrolls @text through one row of the display, one cell to the
+ * left every @interval_ms, repeating with a few blank cells in between. The
+ * driver animates it on its own from a high resolution timer until it is
+ * stopped with @interval_ms = 0 or replaced by another LCD_MARQUEE.
+ * The marquee row is redrawn through the framebuffer, so other rows, writes
+ * and the mmap() grid keep working while it runs. Redrawing a 16 column row
+ * takes about 20ms at 100kHz I2C; with shorter intervals the marquee skips
+ * positions to keep its speed instead of falling behind.
+ */
+#define LCD_MARQUEE_MAX_LEN 256
+
+struct lcd_marquee {
+    int row;                        /* Row to scroll in */
+    int interval_ms;                /* Time per one cell step, 0 stops the marquee */
+    int len;                        /* Number of characters in text */
+    char text[LCD_MARQUEE_MAX_LEN]; /* The message, not NUL terminated */
+};
+
+/*
+ * Custom characters
+ * LCD_LOAD_GLYPH takes a 5x8 bitmap, 8 rows from top to bottom with the
+ * pixels in the low 5 bits of each row, and returns the character code (0-7)
+ * that displays it. The driver keeps the 8 CGRAM slots as a cache: asking for
+ * a glyph that is already loaded returns its code without any I2C traffic, so
+ * glyphs can simply be requested before every use. When all slots are taken
+ * the least recently requested glyph that is not on screen is replaced; if
+ * all of them are on screen, cells showing the replaced glyph change with it.
+ */
+struct lcd_glyph {
+    unsigned char bitmap[8];        /* Glyph rows, top to bottom */
+    int code;                       /* Returned character code to write() */
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * aesd_lcd_trace.h
+ *
+ * Tracepoints of the AESD I2C LCD driver.
+ *
+ * A command can be followed from the ioctl or write() that submitted it,
+ * through the queue, to the bus transfers that carried it out:
+ *
+ *   lcd_cmd_submit -> lcd_cmd_start -> lcd_i2c_xfer ... -> lcd_cmd_done
+ *
+ * Commands are matched by device and sequence number. A command merged into
+ * one that was already queued hands its sequence number over to it, so of a
+ * merged run only the last sequence number is started and completed.
+ *
+ * Example:
+ *   echo 1 > /sys/kernel/tracing/events/aesd_lcd/enable
+ *   perf trace -e 'aesd_lcd:*'
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesd_lcd
+
+#if !defined(_AESD_LCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESD_LCD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lcd_cmd_submit,
+    TP_PROTO(dev_t devt, u64 seq, unsigned int op, size_t len, bool merged),
+    TP_ARGS(devt, seq, op, len, merged),
+
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(u64, seq)
+        __field(unsigned int, op)
+        __field(size_t, len)
+        __field(bool, merged)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = devt;
+        __entry->seq = seq;
+        __entry->op = op;
+        __entry->len = len;
+        __entry->merged = merged;
+    ),
+
+    TP_printk("dev=%d:%d seq=%llu op=%u len=%zu merged=%d",
+              MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->seq, __entry->op, __entry->len, __entry->merged)
+);
+
+DECLARE_EVENT_CLASS(lcd_cmd,
+    TP_PROTO(dev_t devt, u64 seq, unsigned int op),
+    TP_ARGS(devt, seq, op),
+
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(u64, seq)
+        __field(unsigned int, op)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = devt;
+        __entry->seq = seq;
+        __entry->op = op;
+    ),
+
+    TP_printk("dev=%d:%d seq=%llu op=%u",
+              MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->seq, __entry->op)
+);
+
+DEFINE_EVENT(lcd_cmd, lcd_cmd_start,
+    TP_PROTO(dev_t devt, u64 seq, unsigned int op),
+    TP_ARGS(devt, seq, op)
+);
+
+DEFINE_EVENT(lcd_cmd, lcd_cmd_done,
+    TP_PROTO(dev_t devt, u64 seq, unsigned int op),
+    TP_ARGS(devt, seq, op)
+);
+
+TRACE_EVENT(lcd_i2c_xfer,
+    TP_PROTO(dev_t devt, bool read, u8 data, int ret, u64 ns),
+    TP_ARGS(devt, read, data, ret, ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(bool, read)
+        __field(u8, data)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->devt = devt;
+        __entry->read = read;
+        __entry->data = data;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("dev=%d:%d %s data=0x%02x ret=%d ns=%llu",
+              MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->read ? "read" : "write", __entry->data,
+              __entry->ret, __entry->ns)
+);
+
+#endif /* _AESD_LCD_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd_lcd_trace
+#include <trace/define_trace.h>
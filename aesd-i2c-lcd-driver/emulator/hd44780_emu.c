@@ -0,0 +1,256 @@
+/**
+ * @file hd44780_emu.c
+ * @brief Userspace PCF8574 + HD44780 emulator
+ *
+ * The PCF8574 simply drives its 8 pins with the last byte written over I2C.
+ * The HD44780 samples D7..D4 on the falling edge of EN when RW=0, and drives
+ * D7..D4 while EN is high when RW=1. Everything else follows the datasheet
+ * instruction set closely enough to reconstruct what the display shows.
+ *
+ * @author Scott Karl
+ *
+ */
+
+#include <string.h>
+
+#include "hd44780_emu.h"
+#include "../aesd_lcd_hd44780.h"
+
+/*
+ * Time one single-byte SMBus transaction occupies the bus
+ */
+static uint64_t emu_xfer_ns(const struct hd44780_emu *emu)
+{
+    return HD44780_EMU_CLOCKS_PER_XFER * 1000000ull / emu->bus_khz;
+}
+
+/*
+ * Advance the address counter after a data access, as the controller does
+ */
+static void emu_advance_ac(struct hd44780_emu *emu)
+{
+    bool inc = emu->entry_mode & LCD_ENTRY_LEFT;
+
+    if (emu->ac_cgram) {
+        emu->ac = (emu->ac + (inc ? 1 : -1)) & 0x3F;
+        return;
+    }
+
+    if (inc) {
+        if (emu->ac == LCD_DDRAM_LINE_LEN - 1)
+            emu->ac = LCD_DDRAM_LINE2;
+        else if (emu->ac == LCD_DDRAM_LINE2 + LCD_DDRAM_LINE_LEN - 1)
+            emu->ac = 0x00;
+        else
+            emu->ac++;
+    } else {
+        if (emu->ac == 0x00)
+            emu->ac = LCD_DDRAM_LINE2 + LCD_DDRAM_LINE_LEN - 1;
+        else if (emu->ac == LCD_DDRAM_LINE2)
+            emu->ac = LCD_DDRAM_LINE_LEN - 1;
+        else
+            emu->ac--;
+    }
+}
+
+/*
+ * Execute one complete instruction (rs=0) or data write (rs=1)
+ */
+static void emu_execute(struct hd44780_emu *emu, uint8_t byte, bool rs)
+{
+    uint64_t exec_ns = HD44780_EMU_EXEC_NS;
+
+    if (rs) {
+        emu->stats.data++;
+        if (emu->ac_cgram)
+            emu->cgram[emu->ac & 0x3F] = byte;
+        else
+            emu->ddram[emu->ac & 0x7F] = byte;
+        emu_advance_ac(emu);
+
+        /* Entry mode shift moves the display along with the cursor */
+        if (!emu->ac_cgram && (emu->entry_mode & LCD_ENTRY_SHIFT_INC))
+            emu->shift += (emu->entry_mode & LCD_ENTRY_LEFT) ? 1 : -1;
+    } else {
+        emu->stats.instructions++;
+        if (byte & LCD_CMD_SET_DDRAM_ADDR) {
+            emu->ac = byte & 0x7F;
+            emu->ac_cgram = false;
+        } else if (byte & LCD_CMD_SET_CGRAM_ADDR) {
+            emu->ac = byte & 0x3F;
+            emu->ac_cgram = true;
+        } else if (byte & LCD_CMD_FUNCTION_SET) {
+            emu->four_bit = !(byte & LCD_8BIT_MODE);
+            emu->two_line = byte & LCD_2LINE;
+        } else if (byte & LCD_CMD_SHIFT) {
+            bool right = byte & LCD_MOVE_RIGHT;
+
+            if (byte & LCD_DISPLAY_MOVE) {
+                emu->shift += right ? -1 : 1;
+            } else {
+                uint8_t mode = emu->entry_mode;
+
+                emu->entry_mode = right ? LCD_ENTRY_LEFT : 0;
+                emu_advance_ac(emu);
+                emu->entry_mode = mode;
+            }
+        } else if (byte & LCD_CMD_DISPLAY_CTRL) {
+            emu->display_ctrl = byte & 0x07;
+        } else if (byte & LCD_CMD_ENTRY_MODE) {
+            emu->entry_mode = byte & 0x03;
+        } else if (byte & LCD_CMD_RETURN_HOME) {
+            emu->ac = 0;
+            emu->ac_cgram = false;
+            emu->shift = 0;
+            exec_ns = HD44780_EMU_SLOW_EXEC_NS;
+        } else if (byte & LCD_CMD_CLEAR) {
+            memset(emu->ddram, ' ', sizeof(emu->ddram));
+            emu->ac = 0;
+            emu->ac_cgram = false;
+            emu->shift = 0;
+            emu->entry_mode |= LCD_ENTRY_LEFT;
+            exec_ns = HD44780_EMU_SLOW_EXEC_NS;
+        }
+    }
+
+    emu->busy_until_ns = emu->now_ns + exec_ns;
+}
+
+/*
+ * The controller latched a nibble on the falling edge of EN
+ */
+static void emu_latch_nibble(struct hd44780_emu *emu, uint8_t pins)
+{
+    uint8_t nibble = pins & 0xF0;
+    bool rs = pins & LCD_RS_BIT;
+
+    /* A transfer must not start while the previous instruction runs */
+    if (!emu->have_high && emu->now_ns < emu->busy_until_ns)
+        emu->stats.violations++;
+
+    if (!emu->four_bit) {
+        /* 8-bit interface: D3..D0 are not connected and read as 0 */
+        emu_execute(emu, nibble, rs);
+        return;
+    }
+
+    if (!emu->have_high) {
+        emu->high = nibble;
+        emu->have_high = true;
+        return;
+    }
+
+    emu->have_high = false;
+    emu_execute(emu, emu->high | (nibble >> 4), rs);
+}
+
+/*
+ * What the controller drives onto D7..D4 during a read pulse
+ */
+static uint8_t emu_read_nibble(const struct hd44780_emu *emu)
+{
+    uint8_t status = emu->ac & 0x7F;
+
+    if (emu->now_ns < emu->busy_until_ns)
+        status |= 0x80;
+
+    return emu->read_low ? (status << 4) & 0xF0 : status & 0xF0;
+}
+
+/**
+ * hd44780_emu_init() - Power on the emulated display
+ * @emu: Emulator state
+ * @bus_khz: I2C clock used for the timing model
+ * @rw_wired: Whether RW is connected, i.e. whether the busy flag reads back
+ */
+void hd44780_emu_init(struct hd44780_emu *emu, unsigned int bus_khz, bool rw_wired)
+{
+    memset(emu, 0, sizeof(*emu));
+    emu->bus_khz = bus_khz;
+    emu->rw_wired = rw_wired;
+    emu->entry_mode = LCD_ENTRY_LEFT;
+    memset(emu->ddram, ' ', sizeof(emu->ddram));
+}
+
+/**
+ * hd44780_emu_write_byte() - One I2C write transaction to the PCF8574
+ * @emu: Emulator state
+ * @data: New state of the expander outputs
+ */
+void hd44780_emu_write_byte(struct hd44780_emu *emu, uint8_t data)
+{
+    uint8_t prev = emu->latch;
+
+    emu->stats.writes++;
+    emu->stats.bus_ns += emu_xfer_ns(emu);
+    emu->now_ns += emu_xfer_ns(emu);
+    emu->latch = data;
+
+    /* Falling edge of EN */
+    if ((prev & LCD_EN_BIT) && !(data & LCD_EN_BIT)) {
+        if (!(prev & LCD_RW_BIT) || !emu->rw_wired)
+            emu_latch_nibble(emu, prev);
+        else
+            emu->read_low = !emu->read_low;
+    }
+}
+
+/**
+ * hd44780_emu_read_byte() - One I2C read transaction from the PCF8574
+ * @emu: Emulator state
+ *
+ * Return: The level of the 8 expander pins
+ */
+int hd44780_emu_read_byte(struct hd44780_emu *emu)
+{
+    uint8_t pins = emu->latch;
+
+    emu->stats.reads++;
+    emu->stats.bus_ns += emu_xfer_ns(emu);
+    emu->now_ns += emu_xfer_ns(emu);
+
+    /* The LCD can only pull down pins the expander leaves high */
+    if (emu->rw_wired && (pins & LCD_RW_BIT) && (pins & LCD_EN_BIT))
+        pins &= emu_read_nibble(emu) | 0x0F;
+
+    return pins;
+}
+
+/**
+ * hd44780_emu_delay_us() - Let simulated time pass
+ * @emu: Emulator state
+ * @us: Microseconds waited by the driver
+ */
+void hd44780_emu_delay_us(struct hd44780_emu *emu, unsigned int us)
+{
+    emu->stats.delay_ns += us * 1000ull;
+    emu->now_ns += us * 1000ull;
+}
+
+/**
+ * hd44780_emu_render() - Produce the characters currently visible
+ * @emu: Emulator state
+ * @rows: Visible rows of the module
+ * @cols: Visible columns of the module
+ * @out: rows x cols grid receiving the visible characters
+ *
+ * Follows how standard modules wire their rows to DDRAM: even rows in the
+ * first line, odd rows in the second, rows 2/3 right after the visible part
+ * of rows 0/1. Applies the display shift within each 40 character line.
+ */
+void hd44780_emu_render(const struct hd44780_emu *emu, unsigned int rows, unsigned int cols, char *out)
+{
+    unsigned int row, col;
+
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++) {
+            uint8_t addr = ((row & 1) ? LCD_DDRAM_LINE2 : 0x00) + (row >> 1) * cols + col;
+            uint8_t line = addr & LCD_DDRAM_LINE2;
+            int pos = (addr - line + emu->shift) % LCD_DDRAM_LINE_LEN;
+
+            if (pos < 0)
+                pos += LCD_DDRAM_LINE_LEN;
+            out[row * cols + col] = emu->ddram[line + pos];
+        }
+    }
+}
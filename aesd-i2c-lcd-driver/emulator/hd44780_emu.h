@@ -0,0 +1,101 @@
+/*
+ * hd44780_emu.h
+ *
+ * Userspace model of a PCF8574 I2C backpack driving an HD44780 controller.
+ * Decodes the byte stream produced by aesd_lcd_hd44780.c into display state,
+ * and accounts the I2C traffic and simulated time it costs.
+ *
+ *  Author: Scott Karl
+ */
+
+#ifndef HD44780_EMU_H
+#define HD44780_EMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Clock periods per single-byte SMBus transaction:
+ * START + 7 bit address + R/W + ACK + 8 data bits + ACK + STOP */
+#define HD44780_EMU_CLOCKS_PER_XFER 20
+
+/* Instruction execution times from the datasheet (fosc = 270kHz) */
+#define HD44780_EMU_EXEC_NS         37000ull
+#define HD44780_EMU_SLOW_EXEC_NS    1520000ull
+
+/**
+ * struct hd44780_emu_stats - Cost of the traffic seen by the emulator
+ * @writes: Single-byte I2C write transactions
+ * @reads: Single-byte I2C read transactions
+ * @instructions: Instructions executed by the controller (RS=0)
+ * @data: Data bytes written to DDRAM/CGRAM (RS=1)
+ * @bus_ns: Simulated time spent on the I2C bus
+ * @delay_ns: Simulated time spent in driver delays
+ * @violations: Transfers started while the controller was still busy
+ */
+struct hd44780_emu_stats {
+    unsigned long writes;
+    unsigned long reads;
+    unsigned long instructions;
+    unsigned long data;
+    uint64_t bus_ns;
+    uint64_t delay_ns;
+    unsigned long violations;
+};
+
+/**
+ * struct hd44780_emu - Emulated backpack and controller
+ * @bus_khz: I2C clock used to convert transactions into time
+ * @rw_wired: Whether the RW line reaches the LCD, so the busy flag can be read
+ * @now_ns: Simulated time
+ * @latch: Last byte written to the PCF8574 outputs
+ * @four_bit: Controller is in 4-bit interface mode
+ * @have_high: The high nibble of a 4-bit transfer has been latched
+ * @high: The latched high nibble
+ * @read_low: The next read pulse returns the low nibble
+ * @ddram: Display data RAM
+ * @cgram: Character generator RAM (8 glyphs of 8 rows)
+ * @ac: Address counter
+ * @ac_cgram: The address counter points into CGRAM
+ * @entry_mode: Entry mode bits (I/D, S)
+ * @display_ctrl: Display control bits (D, C, B)
+ * @two_line: Function set N bit
+ * @shift: Number of positions the display has been shifted left
+ * @busy_until_ns: Time at which the current instruction finishes
+ * @stats: Traffic accounting
+ */
+struct hd44780_emu {
+    unsigned int bus_khz;
+    bool rw_wired;
+    uint64_t now_ns;
+
+    uint8_t latch;
+    bool four_bit;
+    bool have_high;
+    uint8_t high;
+    bool read_low;
+
+    uint8_t ddram[128];
+    uint8_t cgram[64];
+    uint8_t ac;
+    bool ac_cgram;
+    uint8_t entry_mode;
+    uint8_t display_ctrl;
+    bool two_line;
+    int shift;
+    uint64_t busy_until_ns;
+
+    struct hd44780_emu_stats stats;
+};
+
+extern void hd44780_emu_init(struct hd44780_emu *emu, unsigned int bus_khz, bool rw_wired);
+
+extern void hd44780_emu_write_byte(struct hd44780_emu *emu, uint8_t data);
+
+extern int hd44780_emu_read_byte(struct hd44780_emu *emu);
+
+extern void hd44780_emu_delay_us(struct hd44780_emu *emu, unsigned int us);
+
+extern void hd44780_emu_render(const struct hd44780_emu *emu, unsigned int rows, unsigned int cols, char *out);
+
+#endif /* HD44780_EMU_H */
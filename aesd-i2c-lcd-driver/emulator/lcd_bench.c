@@ -0,0 +1,511 @@
+/**
+ * @file lcd_bench.c
+ * @brief Drive the LCD protocol layer against the HD44780 emulator
+ *
+ * Runs the same display operations the driver performs through
+ * aesd_lcd_hd44780.c, with the I2C transport backed by hd44780_emu.c instead
+ * of a real PCF8574. For every operation it reports the I2C transactions,
+ * the bytes put on the wire and the simulated time spent on the bus and in
+ * delays, in fixed delay mode and in busy flag mode. After every operation
+ * the emulated display must show exactly what the driver believes it shows,
+ * and no instruction may have been sent while the controller was busy.
+ *
+ * Usage: lcd_bench [-b bus_khz] [-g rowsxcols] [-v]
+ *
+ * Exits with status 1 if any operation fails verification.
+ *
+ * @author Scott Karl
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hd44780_emu.h"
+#include "../aesd_lcd_hd44780.h"
+
+/* Bytes on the wire per single-byte transaction: address + data */
+#define BYTES_PER_XFER 2
+
+struct bench {
+    struct hd44780_emu emu;
+    struct lcd_hd44780 lcd;
+    char grid[LCD_MAX_ROWS * LCD_MAX_COLS];
+    unsigned int rows;
+    unsigned int cols;
+    int verbose;
+    int failures;
+};
+
+/* ---------- Transport callbacks backed by the emulator ---------- */
+
+static void emu_ops_write_byte(void *priv, uint8_t data)
+{
+    hd44780_emu_write_byte(priv, data);
+}
+
+static int emu_ops_read_byte(void *priv)
+{
+    return hd44780_emu_read_byte(priv);
+}
+
+static void emu_ops_delay_us(void *priv, unsigned int us)
+{
+    hd44780_emu_delay_us(priv, us);
+}
+
+static uint64_t emu_ops_now_ns(void *priv)
+{
+    return ((struct hd44780_emu *)priv)->now_ns;
+}
+
+static const struct lcd_hd44780_ops emu_ops = {
+    .write_byte = emu_ops_write_byte,
+    .read_byte = emu_ops_read_byte,
+    .delay_us = emu_ops_delay_us,
+    .now_ns = emu_ops_now_ns,
+};
+
+/* ---------- Benchmarked operations ---------- */
+
+static const char *line1 = "Hello from AESD!";
+static const char *line2 = " -- 16x2 LCD -- ";
+
+static void op_init(struct bench *b)
+{
+    lcd_hd44780_init_sequence(&b->lcd);
+    if (b->lcd.busy_poll)
+        b->lcd.busy_poll = lcd_hd44780_busy_flag_wired(&b->lcd);
+    memset(b->grid, ' ', sizeof(b->grid));
+}
+
+static void op_write_line(struct bench *b)
+{
+    lcd_hd44780_write(&b->lcd, line1, strlen(line1), b->grid);
+}
+
+static void op_set_cursor(struct bench *b)
+{
+    lcd_hd44780_set_cursor(&b->lcd, 1, 0);
+}
+
+static void op_write_line2(struct bench *b)
+{
+    lcd_hd44780_write(&b->lcd, line2, strlen(line2), b->grid);
+}
+
+static void op_cursor_on(struct bench *b)
+{
+    lcd_hd44780_set_display_ctrl(&b->lcd, LCD_CURSOR_ON, true);
+}
+
+static void op_clear_write(struct bench *b)
+{
+    lcd_hd44780_clear(&b->lcd);
+    memset(b->grid, ' ', sizeof(b->grid));
+    lcd_hd44780_write(&b->lcd, line1, strlen(line1), b->grid);
+}
+
+static void op_home_write(struct bench *b)
+{
+    lcd_hd44780_home(&b->lcd);
+    lcd_hd44780_write(&b->lcd, "J", 1, b->grid);
+}
+
+static void op_fb_full(struct bench *b)
+{
+    int i;
+
+    for (i = 0; i < b->lcd.rows * b->lcd.cols; i++)
+        b->grid[i] = 'a' + (i % 26);
+    lcd_hd44780_flush(&b->lcd, b->grid);
+}
+
+static void op_fb_one(struct bench *b)
+{
+    b->grid[b->lcd.cols + 7] = '#';
+    lcd_hd44780_flush(&b->lcd, b->grid);
+}
+
+static void op_fb_sparse(struct bench *b)
+{
+    int col;
+
+    for (col = 0; col < b->lcd.cols; col += 4)
+        b->grid[col] = '*';
+    lcd_hd44780_flush(&b->lcd, b->grid);
+}
+
+static void op_fb_unchanged(struct bench *b)
+{
+    lcd_hd44780_flush(&b->lcd, b->grid);
+}
+
+static const char *marquee = "AESD marquee scrolling in the kernel";
+
+static void op_marquee(struct bench *b, size_t pos)
+{
+    lcd_hd44780_marquee_window(marquee, strlen(marquee), pos, b->grid, b->lcd.cols);
+    lcd_hd44780_flush(&b->lcd, b->grid);
+}
+
+static void op_marquee_start(struct bench *b)
+{
+    op_marquee(b, 0);
+}
+
+static void op_marquee_step(struct bench *b)
+{
+    op_marquee(b, 1);
+}
+
+static void op_marquee_wrap(struct bench *b)
+{
+    op_marquee(b, strlen(marquee) + LCD_MARQUEE_GAP);
+}
+
+/*
+ * Check one row of the framebuffer: @text followed by blanks
+ */
+static void expect_row(struct bench *b, unsigned int row, const char *text)
+{
+    char want[LCD_MAX_COLS];
+    size_t len = strlen(text);
+
+    memset(want, ' ', b->lcd.cols);
+    memcpy(want, text, len < b->lcd.cols ? len : b->lcd.cols);
+    if (memcmp(&b->grid[row * b->lcd.cols], want, b->lcd.cols)) {
+        fprintf(stderr, "row %u: expected |%.*s| got |%.*s|\n", row,
+                b->lcd.cols, want, b->lcd.cols, &b->grid[row * b->lcd.cols]);
+        b->failures++;
+    }
+}
+
+static void op_write_lines(struct bench *b)
+{
+    const char *text = "Top\nsecond\rSecond";
+
+    lcd_hd44780_clear(&b->lcd);
+    memset(b->grid, ' ', sizeof(b->grid));
+    lcd_hd44780_write(&b->lcd, text, strlen(text), b->grid);
+    expect_row(b, 0, "Top");
+    expect_row(b, 1, "Second");
+}
+
+/*
+ * Clear Display switches the controller back to left-to-right, so text
+ * written after it must run left-to-right and wrap like any other
+ */
+static void op_rtl_clear(struct bench *b)
+{
+    const char *text = "after clear";
+
+    lcd_hd44780_set_entry_mode(&b->lcd, LCD_ENTRY_LEFT, false);
+    lcd_hd44780_clear(&b->lcd);
+    memset(b->grid, ' ', sizeof(b->grid));
+    lcd_hd44780_write(&b->lcd, text, strlen(text), b->grid);
+    expect_row(b, 0, text);
+}
+
+/*
+ * A full row wraps to the next one, and a newline right after a full row
+ * only moves down once. The last row wraps back to the first.
+ */
+static void op_write_wrap(struct bench *b)
+{
+    char text[LCD_MAX_ROWS * (LCD_MAX_COLS + 1) + 8];
+    char full[LCD_MAX_COLS + 1];
+    unsigned int row;
+    size_t len = 0;
+
+    memset(full, '=', b->lcd.cols);
+    full[b->lcd.cols] = '\0';
+
+    lcd_hd44780_set_cursor(&b->lcd, 0, 0);
+    for (row = 0; row < b->lcd.rows; row++) {
+        memcpy(&text[len], full, b->lcd.cols);
+        len += b->lcd.cols;
+        if (row == 0)
+            text[len++] = '\n';
+    }
+    memcpy(&text[len], "wrap", 4);
+    len += 4;
+
+    lcd_hd44780_write(&b->lcd, text, len, b->grid);
+
+    /* Wrapping from the last row lands back at the start of row 0 */
+    memcpy(full, "wrap", 4);
+    expect_row(b, 0, full);
+    memset(full, '=', 4);
+    for (row = 1; row < b->lcd.rows; row++)
+        expect_row(b, row, full);
+}
+
+/*
+ * Bar graph segment with @level of 5 columns lit
+ */
+static void bar_glyph(uint8_t *bitmap, int level)
+{
+    int row;
+
+    for (row = 0; row < LCD_GLYPH_ROWS; row++)
+        bitmap[row] = (0x1F << (5 - level)) & 0x1F;
+}
+
+/*
+ * Request a glyph and check the emulated CGRAM holds it in the returned slot
+ */
+static int load_glyph(struct bench *b, const uint8_t *bitmap)
+{
+    int code = lcd_hd44780_load_glyph(&b->lcd, bitmap);
+    int row;
+
+    for (row = 0; row < LCD_GLYPH_ROWS; row++) {
+        if (b->emu.cgram[code * LCD_GLYPH_ROWS + row] != bitmap[row]) {
+            fprintf(stderr, "glyph slot %d row %d: expected %02x got %02x\n",
+                    code, row, bitmap[row], b->emu.cgram[code * LCD_GLYPH_ROWS + row]);
+            b->failures++;
+            break;
+        }
+    }
+    return code;
+}
+
+static int bar_code;
+
+static void op_glyph_upload(struct bench *b)
+{
+    uint8_t bitmap[LCD_GLYPH_ROWS];
+    char code;
+
+    bar_glyph(bitmap, 3);
+    bar_code = load_glyph(b, bitmap);
+    code = bar_code;
+    lcd_hd44780_set_cursor(&b->lcd, 1, 0);
+    lcd_hd44780_write(&b->lcd, &code, 1, b->grid);
+}
+
+static void op_glyph_cached(struct bench *b)
+{
+    uint8_t bitmap[LCD_GLYPH_ROWS];
+
+    bar_glyph(bitmap, 3);
+    if (load_glyph(b, bitmap) != bar_code) {
+        fprintf(stderr, "cached glyph moved to another slot\n");
+        b->failures++;
+    }
+}
+
+/*
+ * Fill the remaining slots, then ask for one more: the glyph on screen is the
+ * least recently used one but must not be the one replaced
+ */
+static void op_glyph_evict(struct bench *b)
+{
+    uint8_t bitmap[LCD_GLYPH_ROWS];
+    int i, code;
+
+    for (i = 0; i < LCD_CGRAM_SLOTS; i++) {
+        memset(bitmap, 0, sizeof(bitmap));
+        bitmap[i] = 0x1F;
+        load_glyph(b, bitmap);
+    }
+
+    bar_glyph(bitmap, 3);
+    code = load_glyph(b, bitmap);
+    if (code != bar_code) {
+        fprintf(stderr, "glyph on screen was replaced\n");
+        b->failures++;
+    }
+}
+
+/*
+ * Show the glyph on screen through its second code, slot + 8, then fill every
+ * other slot with new glyphs: it must stay loaded in the same slot
+ */
+static void op_glyph_alias_evict(struct bench *b)
+{
+    uint8_t bitmap[LCD_GLYPH_ROWS];
+    char code = bar_code | 8;
+    int i;
+
+    lcd_hd44780_set_cursor(&b->lcd, 1, 0);
+    lcd_hd44780_write(&b->lcd, &code, 1, b->grid);
+
+    for (i = 0; i < LCD_CGRAM_SLOTS; i++) {
+        memset(bitmap, 0, sizeof(bitmap));
+        bitmap[i] = 0x1F;
+        bitmap[(i + 1) % LCD_GLYPH_ROWS] = 0x1F;
+        load_glyph(b, bitmap);
+    }
+
+    bar_glyph(bitmap, 3);
+    if (load_glyph(b, bitmap) != bar_code) {
+        fprintf(stderr, "glyph shown through code %d was replaced\n", bar_code | 8);
+        b->failures++;
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(struct bench *b);
+} ops[] = {
+    { "init",             op_init },
+    { "write 16 chars",   op_write_line },
+    { "set cursor",       op_set_cursor },
+    { "write 16 chars",   op_write_line2 },
+    { "cursor on",        op_cursor_on },
+    { "clear + write 16", op_clear_write },
+    { "home + write 1",   op_home_write },
+    { "fb flush all",     op_fb_full },
+    { "fb flush 1 cell",  op_fb_one },
+    { "fb flush 4 cells", op_fb_sparse },
+    { "fb flush clean",   op_fb_unchanged },
+    { "marquee start",    op_marquee_start },
+    { "marquee step",     op_marquee_step },
+    { "marquee wrap",     op_marquee_wrap },
+    { "write lines",      op_write_lines },
+    { "rtl + clear",      op_rtl_clear },
+    { "write wrapped",    op_write_wrap },
+    { "glyph upload",     op_glyph_upload },
+    { "glyph cached",     op_glyph_cached },
+    { "glyph 8 + evict",  op_glyph_evict },
+    { "glyph alias",      op_glyph_alias_evict },
+};
+
+/* ---------- Verification and reporting ---------- */
+
+static void print_grid(const char *label, const char *grid, int rows, int cols)
+{
+    int row;
+
+    for (row = 0; row < rows; row++)
+        printf("    %-8s|%.*s|\n", row ? "" : label, cols, &grid[row * cols]);
+}
+
+/*
+ * The emulated display must show what the driver's framebuffer and shadow hold
+ */
+static int verify(struct bench *b, const char *op)
+{
+    char shown[LCD_MAX_ROWS * LCD_MAX_COLS];
+    size_t size = b->lcd.rows * b->lcd.cols;
+    int ok = 1;
+
+    hd44780_emu_render(&b->emu, b->lcd.rows, b->lcd.cols, shown);
+
+    if (memcmp(shown, b->grid, size) || memcmp(shown, b->lcd.shadow, size)) {
+        fprintf(stderr, "%s: display contents mismatch\n", op);
+        ok = 0;
+    }
+    if (!b->emu.four_bit || !b->emu.two_line) {
+        fprintf(stderr, "%s: controller not in 4-bit 2-line mode\n", op);
+        ok = 0;
+    }
+    if (b->emu.stats.violations) {
+        fprintf(stderr, "%s: %lu transfer(s) while busy\n", op, b->emu.stats.violations);
+        ok = 0;
+    }
+
+    if (!ok || b->verbose) {
+        print_grid("display", shown, b->lcd.rows, b->lcd.cols);
+        if (!ok)
+            print_grid("expected", b->grid, b->lcd.rows, b->lcd.cols);
+    }
+    return ok;
+}
+
+static void run_mode(struct bench *b, const char *mode, unsigned int bus_khz, bool rw_wired, bool busy_poll)
+{
+    struct hd44780_emu_stats total = { 0 };
+    size_t i;
+
+    hd44780_emu_init(&b->emu, bus_khz, rw_wired);
+    lcd_hd44780_setup(&b->lcd, &emu_ops, &b->emu);
+    lcd_hd44780_set_geometry(&b->lcd, b->rows, b->cols);
+    b->lcd.busy_poll = busy_poll;
+
+    printf("\n%s (%u kHz, RW %s, %ux%u)\n", mode, bus_khz,
+           rw_wired ? "wired" : "not wired", b->lcd.cols, b->lcd.rows);
+    printf("  %-18s %7s %7s %6s %10s %10s %10s\n",
+           "operation", "xfers", "bytes", "insns", "bus_us", "delay_us", "total_us");
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        struct hd44780_emu_stats before = b->emu.stats;
+        struct hd44780_emu_stats *now = &b->emu.stats;
+        unsigned long xfers;
+
+        ops[i].run(b);
+
+        xfers = (now->writes - before.writes) + (now->reads - before.reads);
+        printf("  %-18s %7lu %7lu %6lu %10.1f %10.1f %10.1f\n",
+               ops[i].name, xfers, xfers * BYTES_PER_XFER,
+               (now->instructions - before.instructions) + (now->data - before.data),
+               (now->bus_ns - before.bus_ns) / 1000.0,
+               (now->delay_ns - before.delay_ns) / 1000.0,
+               ((now->bus_ns - before.bus_ns) + (now->delay_ns - before.delay_ns)) / 1000.0);
+
+        if (!verify(b, ops[i].name))
+            b->failures++;
+
+        total.writes += now->writes - before.writes;
+        total.reads += now->reads - before.reads;
+    }
+
+    printf("  busy flag mode %s, %lu writes, %lu reads, %.1f ms simulated\n",
+           b->lcd.busy_poll ? "active" : "inactive",
+           total.writes, total.reads, b->emu.now_ns / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct bench b;
+    unsigned int bus_khz = 100;
+    int opt;
+
+    b.rows = LCD_DEFAULT_ROWS;
+    b.cols = LCD_DEFAULT_COLS;
+
+    while ((opt = getopt(argc, argv, "b:g:v")) != -1) {
+        switch (opt) {
+            case 'b':
+                bus_khz = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                if (sscanf(optarg, "%ux%u", &b.rows, &b.cols) != 2) {
+                    fprintf(stderr, "Geometry must be given as rowsxcols, e.g. 4x20\n");
+                    return 2;
+                }
+                break;
+            case 'v':
+                b.verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b bus_khz] [-g rowsxcols] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (bus_khz == 0) {
+        fprintf(stderr, "bus_khz must be positive\n");
+        return 2;
+    }
+    /* The operations need a second row and room for the 16 character lines */
+    if (b.rows < 2 || b.cols < LCD_DEFAULT_COLS ||
+        !lcd_hd44780_set_geometry(&b.lcd, b.rows, b.cols)) {
+        fprintf(stderr, "Unsupported geometry %ux%u\n", b.rows, b.cols);
+        return 2;
+    }
+
+    run_mode(&b, "fixed delays", bus_khz, true, false);
+    run_mode(&b, "busy flag", bus_khz, true, true);
+    run_mode(&b, "busy flag fallback", bus_khz, false, true);
+
+    if (b.failures) {
+        printf("\n%d operation(s) FAILED verification\n", b.failures);
+        return 1;
+    }
+    printf("\nall operations verified\n");
+    return 0;
+}
@@ -2,7 +2,10 @@
 #define _POSIX_C_SOURCE 200809L
 
 /* ---- Configuration Switch ---- */
+/* Set to 0 (make USE_LCD_DEVICE=0) to serve the aesdchar device instead */
+#ifndef USE_LCD_DEVICE
 #define USE_LCD_DEVICE 1
+#endif
 
 /* ---- Includes ---- */
 #include <stdio.h>
@@ -24,12 +27,13 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <limits.h>
 
 /* ---- Device Selection Logic ---- */
-#ifdef USE_LCD_DEVICE
+#if USE_LCD_DEVICE
     #include "../aesd-i2c-lcd-driver/aesd_lcd_ioctl.h"
-    #define PACKET_FILE "/dev/aesdlcd"
+    #define PACKET_FILE "/dev/aesdlcd0"
     /* Disable the AESD Char Device timestamp logic if we are using the LCD */
     #undef USE_AESD_CHAR_DEVICE
     #define USE_AESD_CHAR_DEVICE 1 
@@ -48,6 +52,8 @@
 
 #define SERVER_PORT 9000
 #define BUFFER_SIZE 40000
+/* Most bytes a single sendfile() call moves on Linux */
+#define SENDFILE_MAX_COUNT 0x7ffff000
 
 /* ---- Thread Data Structure ---- */
 struct thread_data {
@@ -69,6 +75,24 @@ pthread_t timer_thread_id;
 timer_t timer_id;
 #endif
 
+/* ---- Packet File Locking ---- */
+/* The LCD driver queues the commands of all openers in submission order, so
+ * LCD packets need no serialization here. The data file and the char device
+ * do, so that every reply matches the file contents after its own packet. */
+static void packet_file_lock(void)
+{
+#if !USE_LCD_DEVICE
+    pthread_mutex_lock(&file_mutex);
+#endif
+}
+
+static void packet_file_unlock(void)
+{
+#if !USE_LCD_DEVICE
+    pthread_mutex_unlock(&file_mutex);
+#endif
+}
+
 /* Function declarations */
 static int send_file_to_client(int socketFd);
 static int send_file_to_client_fd(int socketFd, int fileFd);
@@ -76,13 +100,14 @@ static bool parse_ioctl_seek_command(const char *buffer, size_t length, unsigned
 
 /* * Helper for LCD Command Parsing 
  */
-#ifdef USE_LCD_DEVICE
+#if USE_LCD_DEVICE
 /**
  * parse_lcd_command() - Parse incoming strings for LCD IOCTLs
  * @buffer: The data buffer
  * @length: Length of data
  * @cmd_ioctl: Output pointer for the specific IOCTL command (e.g., LCD_CLEAR)
  * @cmd_val: Output pointer for the argument value (e.g., the cursor position int)
+ * @marquee: Storage for the LCD_MARQUEE argument, *cmd_val points to it for that command
  * * Protocol Support:
  * LCD:CLEAR            -> LCD_CLEAR
  * LCD:HOME             -> LCD_HOME
@@ -94,9 +119,11 @@ static bool parse_ioctl_seek_command(const char *buffer, size_t length, unsigned
  * LCD:SCROLL:0|1       -> LCD_SCROLL (0=Left, 1=Right)
  * LCD:TEXTDIR:0|1      -> LCD_TEXT_DIR (0=RTL, 1=LTR)
  * LCD:AUTOSCROLL:1|0   -> LCD_AUTOSCROLL
+ * LCD:MARQUEE:r,ms,txt -> LCD_MARQUEE (scroll txt in row r, one step per ms, ms=0 stops)
  */
 static bool parse_lcd_command(const char *buffer, size_t length, 
-                              unsigned int *cmd_ioctl, unsigned long *cmd_val)
+                              unsigned int *cmd_ioctl, unsigned long *cmd_val,
+                              struct lcd_marquee *marquee)
 {
     /* Minimum length check for "LCD:" + 1 char */
     if (length < 5 || strncmp(buffer, "LCD:", 4) != 0) return false;
@@ -157,6 +184,29 @@ static bool parse_lcd_command(const char *buffer, size_t length,
         *cmd_val = atoi(p + 11);
         return true;
     }
+    if (strncmp(p, "MARQUEE:", 8) == 0) {
+        /* The text runs up to the newline ending the packet */
+        const char *end = buffer + length;
+        int text_offset = 0;
+
+        *cmd_ioctl = LCD_MARQUEE;
+        memset(marquee, 0, sizeof(*marquee));
+        if (sscanf(p + 8, "%d,%d,%n", &marquee->row, &marquee->interval_ms, &text_offset) != 2)
+            return false;
+        *cmd_val = (unsigned long)marquee;
+        /* "LCD:MARQUEE:r,0" stops the marquee and needs no text */
+        if (text_offset == 0)
+            return marquee->interval_ms == 0;
+
+        if (end > buffer && end[-1] == '\n') end--;
+        if (end > buffer && end[-1] == '\r') end--;
+
+        const char *text = p + 8 + text_offset;
+        marquee->len = (end > text) ? end - text : 0;
+        if (marquee->len > LCD_MARQUEE_MAX_LEN) marquee->len = LCD_MARQUEE_MAX_LEN;
+        memcpy(marquee->text, text, marquee->len);
+        return true;
+    }
 
     return false;
 }
@@ -320,6 +370,10 @@ static bool parse_ioctl_seek_command(const char *buffer, size_t length,
 
 /**
  * send_file_to_client_fd() - Send file contents to client using file descriptor
+ *
+ * Uses sendfile() from the current file position, which moves the data to the
+ * socket inside the kernel. Falls back to read() and send() through a user buffer
+ * when the file does not support it.
  */
 static int send_file_to_client_fd(int socketFd, int fileFd)
 {
@@ -328,6 +382,22 @@ static int send_file_to_client_fd(int socketFd, int fileFd)
     ssize_t bytesSent = 0;
     ssize_t totalSent = 0;
 
+    /* sendfile() advances the file position itself, and returns 0 at the end */
+    while ((bytesSent = sendfile(socketFd, fileFd, NULL, SENDFILE_MAX_COUNT)) != 0)
+    {
+        if (bytesSent == -1)
+        {
+            if (errno == EINTR) continue;
+            if (totalSent == 0 && (errno == EINVAL || errno == ENOSYS)) break;
+            syslog(LOG_ERR, "Error %d (%s) sending file to client", errno, strerror(errno));
+            return 1;
+        }
+        totalSent += bytesSent;
+    }
+    if (bytesSent == 0) {
+        return 0;
+    }
+
     /* Read file chunk by chunk from current file position and send */
     while ((bytesRead = read(fileFd, buffer, BUFFER_SIZE)) > 0)
     {
@@ -437,10 +507,11 @@ static void* handle_client(void* arg)
                 unsigned long ioctl_arg_val = 0; 
                 unsigned int write_cmd_offset = 0;
                 
-                #ifdef USE_LCD_DEVICE
+                #if USE_LCD_DEVICE
                     /* LCD Command Parsing */
                     /* Remove newline for parsing logic */
-                    is_ioctl_cmd = parse_lcd_command(receiveBuffer, packetLen, &ioctl_cmd, &ioctl_arg_val);
+                    struct lcd_marquee marquee;
+                    is_ioctl_cmd = parse_lcd_command(receiveBuffer, packetLen, &ioctl_cmd, &ioctl_arg_val, &marquee);
                 #else
                     /* AESD Char Parsing */
                     is_ioctl_cmd = parse_ioctl_seek_command(receiveBuffer, packetLen, 
@@ -448,28 +519,29 @@ static void* handle_client(void* arg)
                 #endif
 
                 /* Lock mutex before file operations */
-                pthread_mutex_lock(&file_mutex);
+                packet_file_lock();
                 
                 if (is_ioctl_cmd) {                     
                     /* Open the device file with read/write access using file descriptor */
                     syslog(LOG_INFO, "Writing command to aesdlcd");
-                #ifdef USE_LCD_DEVICE
+                #if USE_LCD_DEVICE
                     int fileFd = open(PACKET_FILE, O_WRONLY);
                 #else
                     int fileFd = open(PACKET_FILE, O_RDWR);
                 #endif
                     if (fileFd < 0) {
                         syslog(LOG_ERR, "Error %d (%s) opening %s for ioctl", errno, strerror(errno), PACKET_FILE);
-                        pthread_mutex_unlock(&file_mutex);
+                        packet_file_unlock();
                         clientConnected = false;
                         break;
                     }
                     
                     long ioctl_result = 0;
 
-                    #ifdef USE_LCD_DEVICE
+                    #if USE_LCD_DEVICE
                         /* EXECUTE LCD IOCTL */
-                        /* The LCD driver expects the value directly in the arg parameter */
+                        /* The LCD driver expects the value directly in the arg parameter,
+                         * except LCD_MARQUEE where ioctl_arg_val points at the marquee struct */
                         ioctl_result = ioctl(fileFd, ioctl_cmd, ioctl_arg_val);
                         if (ioctl_result < 0) {
                             syslog(LOG_ERR, "Error %d (%s) ioctl failed", errno, strerror(errno));
@@ -486,7 +558,7 @@ static void* handle_client(void* arg)
                         if (ioctl_result < 0) {
                             syslog(LOG_ERR, "Error %d (%s) ioctl failed", errno, strerror(errno));
                             close(fileFd);
-                            pthread_mutex_unlock(&file_mutex);
+                            packet_file_unlock();
                             clientConnected = false;
                             break;
                         }
@@ -496,7 +568,7 @@ static void* handle_client(void* arg)
                         if (send_file_to_client_fd(clientFd, fileFd) != 0) {
                             /* Error sending file content, assume client disconnected */
                             close(fileFd);
-                            pthread_mutex_unlock(&file_mutex);
+                            packet_file_unlock();
                             clientConnected = false;
                             break;
                         }
@@ -509,13 +581,13 @@ static void* handle_client(void* arg)
                     /* Normal packet - write to file and send back contents */
                     syslog(LOG_INFO, "Writing command to aesdlcd: %.*s", (int)packetLen, receiveBuffer);
                     
-                #ifdef USE_LCD_DEVICE
+                #if USE_LCD_DEVICE
                     /* For LCD device: use open()/write() and strip the newline character
                      * since the HD44780 LCD cannot display newlines as printable characters */
                     int fileFd = open(PACKET_FILE, O_WRONLY);
                     if (fileFd < 0) {
                         syslog(LOG_ERR, "Error %d (%s) opening %s for writing", errno, strerror(errno), PACKET_FILE);
-                        pthread_mutex_unlock(&file_mutex);
+                        packet_file_unlock();
                         clientConnected = false;
                         break;
                     }
@@ -541,7 +613,7 @@ static void* handle_client(void* arg)
                     if(outputFilePtr == NULL)
                     {
                         syslog(LOG_ERR, "Error %d (%s) opening %s for appending", errno, strerror(errno), PACKET_FILE);
-                        pthread_mutex_unlock(&file_mutex);
+                        packet_file_unlock();
                         clientConnected = false;
                         break; // break from newline processing loop
                     }
@@ -554,7 +626,7 @@ static void* handle_client(void* arg)
                     if(send_file_to_client(clientFd) != 0)
                     {
                         /* Error sending file content, assume client disconnected */
-                        pthread_mutex_unlock(&file_mutex);
+                        packet_file_unlock();
                         clientConnected = false;
                         break; // break from newline processing loop
                     }
@@ -562,7 +634,7 @@ static void* handle_client(void* arg)
                 }
 
                 /* Unlock mutex after file operations */
-                pthread_mutex_unlock(&file_mutex);
+                packet_file_unlock();
 
                 /* Remove processed packet from buffer */
                 size_t remainingLen = receiveBufferLen - packetLen;